@@ -32,7 +32,33 @@
 #include <charconv>
 #include <span>
 #include <utility>
+#if __has_include("expression.h")
 #include "expression.h"
+#else
+class CExprBuilder // Same interface as expression.h of the parser archive, which only ships for arm64-darwin
+{
+  public:
+    virtual ~CExprBuilder ( void ) noexcept = default;
+    virtual void opAdd ( void ) = 0;
+    virtual void opSub ( void ) = 0;
+    virtual void opMul ( void ) = 0;
+    virtual void opDiv ( void ) = 0;
+    virtual void opPow ( void ) = 0;
+    virtual void opNeg ( void ) = 0;
+    virtual void opEq ( void ) = 0;
+    virtual void opNe ( void ) = 0;
+    virtual void opLt ( void ) = 0;
+    virtual void opLe ( void ) = 0;
+    virtual void opGt ( void ) = 0;
+    virtual void opGe ( void ) = 0;
+    virtual void valNumber ( double val ) = 0;
+    virtual void valString ( std::string val ) = 0;
+    virtual void valReference ( std::string val ) = 0;
+    virtual void valRange ( std::string val ) = 0;
+    virtual void funcCall ( std::string fnName, int paramCount ) = 0;
+};
+void parseExpression ( std::string expr, CExprBuilder & builder ); // Defined only by the archive, see SPREADSHEET_ARCHIVE_PARSER
+#endif
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
 
@@ -40,277 +66,392 @@ constexpr unsigned                     SPREADSHEET_CYCLIC_DEPS                 =
 constexpr unsigned                     SPREADSHEET_FUNCTIONS                   = 0x02;
 constexpr unsigned                     SPREADSHEET_FILE_IO                     = 0x04;
 constexpr unsigned                     SPREADSHEET_SPEED                       = 0x08;
-//constexpr unsigned                     SPREADSHEET_PARSER                      = 0x10;
+constexpr unsigned                     SPREADSHEET_PARSER                      = 0x10;
 #endif /* __PROGTEST__ */
 #include <regex>
+#include <thread>
+#include <bit>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define SPREADSHEET_CRC_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 class CPos;
 std::pair<int,int> CPos_parser(std::string_view str);
 class CSpreadsheet;
 
 
-class Expr // Parent class used for polymorphic implementation & evaluation of formulas
+enum class ExprOp : uint8_t // Opcodes of compiled formula program, nodes are written in postfix order
 {
-public:
-  virtual CValue eval(CSpreadsheet *spreadsheat) const = 0;
-  virtual int getType() const = 0;
-  virtual ~Expr() = default; 
+  NUMBER,
+  TEXT,
+  REFERENCE,
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  POW,
+  NEG,
+  EQ,
+  NE,
+  LT,
+  LE,
+  GT,
+  GE,
+  BROKEN_REFERENCE // #REF! left by deleted rows or columns, has no operand
 };
 
-using ExprPtr = std::shared_ptr<Expr>;
+template <typename T>
+void put_le(std::string &out, T value) // Appends unsigned integer in little-endian byte order
+{
+  for (size_t i = 0; i < sizeof(T); ++i)
+    out.push_back(char((value >> (8 * i)) & 0xff));
+}
 
-class Numeric : public Expr
+template <typename T>
+T get_le(const char *data) // Reads unsigned integer stored in little-endian byte order
 {
-private:
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    value |= T((unsigned char)data[i]) << (8 * i);
+  return value;
+}
+
+void put_double(std::string &out, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put_le(out, bits);
+}
+
+double get_double(const char *data)
+{
+  uint64_t bits = get_le<uint64_t>(data);
   double value;
-public:
-  explicit Numeric(double val) : value(val) {};
-  int getType()const override{ return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+struct CNumberText // Shortest text that parses back to the same double, kept on the stack
+{
+  explicit CNumberText(double value) : length(std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer) {}
+  std::string_view view() const { return std::string_view(buffer, length); }
+  char buffer[32]; // Longest shortest form, like -2.2250738585072014e-308, takes 24
+  size_t length;
+};
+
+std::string number_to_text(double value) // Shortest text that parses back to the same double
+{
+  return std::string(CNumberText(value).view());
+}
+
+constexpr std::array<uint32_t, 256> CRC32C_TABLE = []
+{
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i)
   {
-    return value;
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1; // Reflected Castagnoli polynomial
+    table[i] = crc;
   }
-};
+  return table;
+}();
 
-class Text : public Expr
+uint32_t crc32c_table(uint32_t crc, const unsigned char *data, size_t size)
 {
-public:
-  explicit Text(std::string &val) : value(std::move(val)) {}
-  int getType()const override{ return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
+  for (size_t i = 0; i < size; ++i)
+    crc = CRC32C_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef SPREADSHEET_CRC_SSE42
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size)
+{
+#if defined(__x86_64__)
+  uint64_t wide = crc;
+  for (; size >= 8; data += 8, size -= 8)
   {
-    return value;
+    uint64_t word;
+    memcpy(&word, data, 8);
+    wide = _mm_crc32_u64(wide, word);
   }
-private:
-  std::string value;
-};
+  crc = uint32_t(wide);
+#else // _mm_crc32_u64 only exists in 64-bit mode
+  for (; size >= 4; data += 4, size -= 4)
+  {
+    uint32_t word;
+    memcpy(&word, data, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif
+  for (; size > 0; ++data, --size)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+#endif
 
-class Sum : public Expr {
-private:
-    ExprPtr left, right;
+uint32_t crc32c(std::string_view data) // CRC32C (Castagnoli), uses the CPU instruction when available
+{
+  auto bytes = reinterpret_cast<const unsigned char *>(data.data());
+  uint32_t crc = ~0u;
+#if defined(SPREADSHEET_CRC_SSE42)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  crc = hardware ? crc32c_sse42(crc, bytes, data.size()) : crc32c_table(crc, bytes, data.size());
+#elif defined(__ARM_FEATURE_CRC32)
+  size_t size = data.size();
+  for (; size >= 8; bytes += 8, size -= 8)
+  {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    crc = __crc32cd(crc, word);
+  }
+  crc = crc32c_table(crc, bytes, size);
+#else
+  crc = crc32c_table(crc, bytes, data.size());
+#endif
+  return ~crc;
+}
+
+class CText // Immutable string passed around by handle, copies only touch the reference count
+{ // Equal texts interned by one CStringPool usually share the string, so they compare by pointer
 public:
-    Sum(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-    int getType()const override{ return 0; }
-    CValue eval(CSpreadsheet *spreadsheet) const override {
-        auto lVal = left->eval(spreadsheet);
-        auto rVal = right->eval(spreadsheet);
-        if (std::holds_alternative<std::monostate>(lVal) || std::holds_alternative<std::monostate>(rVal))
-            return std::monostate();
-        if (std::holds_alternative<double>(lVal) && std::holds_alternative<double>(rVal))
-          return std::get<double>(lVal) + std::get<double>(rVal);
-        else if(std::holds_alternative<double>(lVal) && std::holds_alternative<std::string>(rVal))
-          return std::to_string(std::get<double>(lVal)) + std::get<std::string>(rVal);
-        else if(std::holds_alternative<std::string>(lVal) && std::holds_alternative<double>(rVal))
-          return  std::get<std::string>(lVal )+ std::to_string(std::get<double>(rVal));
-        else
-          return  std::get<std::string>(lVal ) + std::get<std::string>(rVal);
+  explicit CText(std::string value) : m_value(std::make_shared<const std::string>(std::move(value))) {}
+  explicit CText(std::shared_ptr<const std::string> value) : m_value(std::move(value)) {}
+  const std::string &str() const { return *m_value; }
+  bool operator==(const CText &other) const { return m_value == other.m_value || *m_value == *other.m_value; }
+  std::strong_ordering operator<=>(const CText &other) const { return *m_value <=> *other.m_value; }
 
-    }
+private:
+  std::shared_ptr<const std::string> m_value;
 };
 
-class Subtraction : public Expr {
-private:
-    ExprPtr left, right;
+using CEvalValue = std::variant<std::monostate, double, CText>; // CValue inside the sheet, texts are shared instead of copied
+
+CValue to_value(const CEvalValue &value) // Copies text out for the caller, the only place reading text allocates
+{
+  if (const CText *text = std::get_if<CText>(&value))
+    return text->str();
+  if (const double *number = std::get_if<double>(&value))
+    return *number;
+  return CValue();
+}
 
+CEvalValue to_eval_value(const CValue &value)
+{
+  if (const std::string *text = std::get_if<std::string>(&value))
+    return CText(*text);
+  if (const double *number = std::get_if<double>(&value))
+    return *number;
+  return CEvalValue();
+}
+
+class CStringPool // Shares equal texts of cells through a small direct-mapped table of recently interned ones
+{ // Equal texts that meet in a slot after it was taken over keep separate strings, they still compare equal by content.
+  // One hash and no index insert per text, so loads of mostly distinct texts do not pay for sharing
 public:
-    Subtraction(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-    int getType()const override{ return 0; }
-
-        
-    CValue eval(CSpreadsheet *spreadsheet) const override {
-        auto lVal = left->eval(spreadsheet);
-        auto rVal = right->eval(spreadsheet);
-        if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-            return std::monostate();
-        else if(std::holds_alternative<std::monostate>(lVal))
-            return std::get<double>(rVal);
-        else if(std::holds_alternative<std::monostate>(rVal))
-            return std::get<double>(lVal);
-
-        return std::get<double>(lVal) - std::get<double>(rVal);
-    }
+  static constexpr size_t SLOTS = 4096;
+  CText intern(std::string_view text);
+
+private:
+  std::vector<std::shared_ptr<const std::string>> m_slots; // Allocated on first use, every sheet owns a pool
 };
 
-class Negative : public Expr
+CText CStringPool::intern(std::string_view text)
+{
+  if (m_slots.empty())
+    m_slots.resize(SLOTS);
+  std::shared_ptr<const std::string> &slot = m_slots[std::hash<std::string_view>()(text) % SLOTS];
+  if (!slot || *slot != text)
+    slot = std::make_shared<const std::string>(text);
+  return CText(slot);
+}
+
+class Expr // Parent class used for polymorphic implementation & evaluation of formulas
 {
-private:
-  ExprPtr left;
 public:
-  Negative(ExprPtr l) : left(std::move(l)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
-  {
-    if (!std::holds_alternative<double>(left->eval(spreadsheat)))
-      return std::monostate();
-    return -(std::get<double>(left->eval(spreadsheat)));
-  }
+  virtual CEvalValue eval(CSpreadsheet *spreadsheat) const = 0;
+  virtual void serialize(std::string &out) const = 0; // Appends node as postfix program, see ExprOp
+  virtual int getType() const = 0;
+  virtual ~Expr() = default; 
 };
 
-class Multiplication : public Expr
+using ExprPtr = std::shared_ptr<Expr>;
+
+class Numeric final : public Expr
 {
 private:
-  ExprPtr left, right;
+  double value;
 public:
-  Multiplication(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
+  explicit Numeric(double val) : value(val) {};
+  int getType()const override{ return 0; }
+  void serialize(std::string &out) const override
   {
-    auto lVal = left->eval(spreadsheat);
-    auto rVal = right->eval(spreadsheat);
-
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate(); // or 0?
-
-    return std::get<double>(lVal) * std::get<double>(rVal);
+    out.push_back(char(ExprOp::NUMBER));
+    put_double(out, value);
+  }
+  CEvalValue eval(CSpreadsheet *spreadsheat) const override
+  {
+    return value;
   }
 };
 
-class Division : public Expr
+class Text final : public Expr
 {
-private:
-  ExprPtr left, right;
 public:
-  Division(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
+  explicit Text(std::string &val) : value(std::move(val)) {}
+  int getType()const override{ return 0; }
+  void serialize(std::string &out) const override
   {
-    auto lVal = left->eval(spreadsheat);
-    auto rVal = right->eval(spreadsheat);
-    if ( !std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal) || (std::get<double>(right->eval(spreadsheat)) == 0) )
-    {
-      return std::monostate();
-    }
-    return std::get<double>(lVal) / std::get<double>(rVal);
+    out.push_back(char(ExprOp::TEXT));
+    put_le<uint32_t>(out, value.str().size());
+    out += value.str();
+  }
+  CEvalValue eval(CSpreadsheet *spreadsheat) const override
+  {
+    return value;
   }
+private:
+  CText value;
 };
 
-class Power : public Expr
+class BrokenReference final : public Expr // Reference to deleted cell, reads as empty cell
 {
-private:
-  ExprPtr left, right;
-
 public:
-  Power(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet *spreadsheat) const override
-  {
+  int getType() const override { return 1; }
+  void serialize(std::string &out) const override { out.push_back(char(ExprOp::BROKEN_REFERENCE)); }
+  CEvalValue eval(CSpreadsheet *) const override { return CEvalValue(); }
+};
 
-    auto lVal = left->eval(spreadsheat);
-    auto rVal = right->eval(spreadsheat);
+CText concatenate(std::string_view left, std::string_view right) // Text sum, allocated once at its final size
+{ // Numbers come formatted on the stack by CNumberText, in their shortest form
+  std::string text;
+  text.reserve(left.size() + right.size());
+  text.append(left).append(right);
+  return CText(std::move(text));
+}
 
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate();
-    return pow(std::get<double>(lVal), std::get<double>(rVal));
-  }
+struct CAdd // Numbers add up, a text operand turns the sum into concatenation
+{
+  CEvalValue operator()(double l, double r) const { return l + r; }
+  CEvalValue operator()(double l, const CText &r) const { return concatenate(CNumberText(l).view(), r.str()); }
+  CEvalValue operator()(const CText &l, double r) const { return concatenate(l.str(), CNumberText(r).view()); }
+  CEvalValue operator()(const CText &l, const CText &r) const { return concatenate(l.str(), r.str()); }
+  template <typename L, typename R>
+  CEvalValue operator()(const L &, const R &) const { return std::monostate(); }
 };
 
-class Equal:public Expr{
-private:
-  ExprPtr left, right;
-public:
-  Equal(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) == std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if(std::holds_alternative<double>(lVal) && std::holds_alternative<double>(rVal))
-      return (std::get<double>(lVal) == std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
-    else return std::monostate(); 
-  }
+template <typename TOperation>
+struct CArithmetic // Only numbers take part, anything else gives no value
+{
+  CEvalValue operator()(double l, double r) const { return TOperation()(l, r); }
+  template <typename L, typename R>
+  CEvalValue operator()(const L &, const R &) const { return std::monostate(); }
 };
 
-class NotEqual:public Expr{
-private:
-  ExprPtr left, right;
-public:
-  NotEqual(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) != std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate(); 
-    return (std::get<double>(lVal) != std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
+struct CDivide
+{
+  CEvalValue operator()(double l, double r) const
+  {
+    if (r == 0)
+      return std::monostate();
+    return l / r;
   }
 };
 
-class LowerThen:public Expr{
-private:
-  ExprPtr left, right;
-public:
-  LowerThen(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) < std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate(); // or 0?
-    return (std::get<double>(lVal) < std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
-  }
+struct CPower
+{
+  CEvalValue operator()(double l, double r) const { return pow(l, r); }
 };
 
-class LowerEq:public Expr{
-private:
-  ExprPtr left, right;
-public:
-  LowerEq(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
-  int getType() const override { return 0; }
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) <= std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate(); 
-    return (std::get<double>(lVal) <= std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
-  }
+template <typename TCompare>
+struct CComparison // Numbers compare with numbers and texts with texts, 1 for true and 0 for false
+{
+  CEvalValue operator()(double l, double r) const { return TCompare()(l, r) ? 1. : 0.; }
+  CEvalValue operator()(const CText &l, const CText &r) const { return TCompare()(l, r) ? 1. : 0.; }
+  template <typename L, typename R>
+  CEvalValue operator()(const L &, const R &) const { return std::monostate(); }
 };
 
-class GreaterThen:public Expr{
+template <ExprOp OP, typename TOperation>
+class BinaryExpr final : public Expr // Binary operator node, TOperation has an overload for each pair of operand types
+{ // Number x number and text x text are tested first and inlined, std::visit picks the overload for mixed pairs
 private:
   ExprPtr left, right;
 public:
-  GreaterThen(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
+  BinaryExpr(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
   int getType() const override { return 0; }
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) > std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
-      return std::monostate(); 
-    return (std::get<double>(lVal) > std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
+  void serialize(std::string &out) const override
+  {
+    left->serialize(out);
+    right->serialize(out);
+    out.push_back(char(OP));
+  }
+  CEvalValue eval(CSpreadsheet *spreadsheet) const override
+  {
+    CEvalValue lVal = left->eval(spreadsheet);
+    CEvalValue rVal = right->eval(spreadsheet);
+    const double *l = std::get_if<double>(&lVal), *r = std::get_if<double>(&rVal);
+    if (l && r)
+      return TOperation()(*l, *r);
+    const CText *lText = std::get_if<CText>(&lVal), *rText = std::get_if<CText>(&rVal);
+    if (lText && rText)
+      return TOperation()(*lText, *rText);
+    return std::visit(TOperation(), lVal, rVal);
   }
 };
 
-class GreaterEqual:public Expr{
+using Sum = BinaryExpr<ExprOp::ADD, CAdd>;
+using Subtraction = BinaryExpr<ExprOp::SUB, CArithmetic<std::minus<>>>;
+using Multiplication = BinaryExpr<ExprOp::MUL, CArithmetic<std::multiplies<>>>;
+using Division = BinaryExpr<ExprOp::DIV, CArithmetic<CDivide>>;
+using Power = BinaryExpr<ExprOp::POW, CArithmetic<CPower>>;
+using Equal = BinaryExpr<ExprOp::EQ, CComparison<std::equal_to<>>>;
+using NotEqual = BinaryExpr<ExprOp::NE, CComparison<std::not_equal_to<>>>;
+using LowerThen = BinaryExpr<ExprOp::LT, CComparison<std::less<>>>;
+using LowerEq = BinaryExpr<ExprOp::LE, CComparison<std::less_equal<>>>;
+using GreaterThen = BinaryExpr<ExprOp::GT, CComparison<std::greater<>>>;
+using GreaterEqual = BinaryExpr<ExprOp::GE, CComparison<std::greater_equal<>>>;
+
+class Negative final : public Expr
+{
 private:
-  ExprPtr left, right;
+  ExprPtr left;
 public:
-  GreaterEqual(ExprPtr l, ExprPtr r) : left(std::move(l)), right(std::move(r)) {}
+  Negative(ExprPtr l) : left(std::move(l)) {}
   int getType() const override { return 0; }
-
-
-  CValue eval(CSpreadsheet* spreadsheet) const override {
-    auto lVal = left->eval(spreadsheet);
-    auto rVal = right->eval(spreadsheet);
-    if (std::holds_alternative<std::string>(lVal) && std::holds_alternative<std::string>(rVal))
-      return (std::get<std::string>(lVal) >= std::get<std::string>(rVal))? CValue(1.) :CValue(0.) ;
-    if (!std::holds_alternative<double>(lVal) || !std::holds_alternative<double>(rVal))
+  void serialize(std::string &out) const override
+  {
+    left->serialize(out);
+    out.push_back(char(ExprOp::NEG));
+  }
+  CEvalValue eval(CSpreadsheet *spreadsheat) const override
+  {
+    CEvalValue value = left->eval(spreadsheat);
+    if (!std::holds_alternative<double>(value))
       return std::monostate();
-    return (std::get<double>(lVal) >= std::get<double>(rVal))? CValue(1.) :CValue(0.) ;
+    return -std::get<double>(value);
   }
 };
 
 //------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+inline uint64_t pack_position(unsigned row, unsigned column) // Orders like CPos::operator<, row in the high half
+{
+  return uint64_t(row) << 32 | column;
+}
+
 class expBuilder : public CExprBuilder
 {
 public:
@@ -429,16 +570,26 @@ public:
   };
   void valString(std::string val) override
   {
-    exprStack.push(std::make_shared<Text>(val));
+    valString(std::string_view(val));
     return;
   };
+  void valString(std::string_view val) // Views are used by CFormulaParser, they point into the formula text
+  {
+    std::string text(val);
+    exprStack.push(std::make_shared<Text>(text));
+  }
   void valReference(std::string val) override; // @note is on the bottom of the code, due to incopetence arrange code differently
+  void valReference(std::string_view val);
+  void valReference(const CPos &pos);
+  void valBrokenReference() { exprStack.push(std::make_shared<BrokenReference>()); } // Not in CExprBuilder, only CFormulaParser reads #REF!
 
   void valRange(std::string val) override
   {
     return;
   };
+  void valRange(std::string_view) {} // No function reads ranges, so they depend on nothing
   void funcCall(std::string fnName, int paramCount) override { return; }; 
+  void funcCall(std::string_view, int) {}
 
   ExprPtr getResult() const
   {
@@ -449,11 +600,314 @@ public:
     return exprStack.top();
   }
 
-  std::stack<ExprPtr> exprStack;
+  void sortReferences() // Call once the formula is complete
+  {
+    std::sort(references.begin(), references.end());
+    references.erase(std::unique(references.begin(), references.end()), references.end());
+  }
+
+  std::stack<ExprPtr, std::vector<ExprPtr>> exprStack; // Vector backed, an empty deque allocates and every cell owns one builder
+  std::vector<uint64_t> references; // pack_position of every referenced cell, collected while the formula is built
 };
 
+void replay_program(std::string_view program, expBuilder &builder, int rowShift = 0, int columnShift = 0);
+
 //------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+std::from_chars_result scan_formula_number(const char *begin, const char *end, double &value) // strtod syntax: decimal or 0x hexadecimal, longest valid prefix
+{
+  std::from_chars_result result{begin, std::errc::invalid_argument};
+  if (end - begin > 2 && begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X'))
+    result = std::from_chars(begin + 2, end, value, std::chars_format::hex);
+  if (result.ec == std::errc::invalid_argument)
+    result = std::from_chars(begin, end, value);
+  return result;
+}
+
+template <typename TBuilder>
+class CFormulaParser // Same grammar as parseExpression, but reads a view and passes views to the builder, nothing is allocated per token
+{ // Builder needs CExprBuilder's op*/valNumber methods, valString, valReference, valRange, funcCall taking std::string_view and valBrokenReference
+public:
+  CFormulaParser(std::string_view formula, TBuilder &builder) : text(formula), builder(builder) {}
+
+  void parse() // Throws std::invalid_argument on syntax error, like parseExpression
+  {
+    skipSpace();
+    if (pos == text.size() || text[pos] != '=')
+      fail("Formula must start with '='");
+    ++pos;
+    comparison();
+    skipSpace();
+    if (pos != text.size())
+      fail("Unexpected text after formula");
+  }
+
+private:
+  [[noreturn]] static void fail(const char *message) { throw std::invalid_argument(message); }
+  static bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); } // <cctype> in "C" locale, without the call
+  static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+  static bool isLetter(char c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+
+  void skipSpace()
+  {
+    while (pos < text.size() && isSpace(text[pos]))
+      ++pos;
+  }
+  char peek() // Next character after spaces, '\0' at the end
+  {
+    skipSpace();
+    return pos < text.size() ? text[pos] : '\0';
+  }
+  bool accept(char token)
+  {
+    if (peek() != token)
+      return false;
+    ++pos;
+    return true;
+  }
+
+  void comparison() // Lowest precedence, all levels are left associative
+  {
+    sum();
+    while (true)
+    {
+      char c = peek(), next = pos + 1 < text.size() ? text[pos + 1] : '\0';
+      if (c != '<' && c != '>' && c != '=')
+        return;
+      bool twoChars = (c != '=' && next == '=') || (c == '<' && next == '>');
+      pos += twoChars ? 2 : 1;
+      sum();
+      if (c == '=')
+        builder.opEq();
+      else if (!twoChars)
+        c == '<' ? builder.opLt() : builder.opGt();
+      else if (next == '>')
+        builder.opNe();
+      else
+        c == '<' ? builder.opLe() : builder.opGe();
+    }
+  }
+  void sum()
+  {
+    product();
+    while (true)
+    {
+      char c = peek();
+      if (c != '+' && c != '-')
+        return;
+      ++pos;
+      product();
+      c == '+' ? builder.opAdd() : builder.opSub();
+    }
+  }
+  void product()
+  {
+    negation();
+    while (true)
+    {
+      char c = peek();
+      if (c != '*' && c != '/')
+        return;
+      ++pos;
+      negation();
+      c == '*' ? builder.opMul() : builder.opDiv();
+    }
+  }
+  void negation() // -2^2 is -(2^2)
+  {
+    if (accept('-'))
+      negation(), builder.opNeg();
+    else
+      power();
+  }
+  void power() // 2^3^2 is (2^3)^2, exponent may be negated
+  {
+    value();
+    while (accept('^'))
+    {
+      exponent();
+      builder.opPow();
+    }
+  }
+  void exponent()
+  {
+    if (accept('-'))
+      exponent(), builder.opNeg();
+    else
+      value();
+  }
+
+  void value()
+  {
+    skipSpace();
+    if (pos == text.size())
+      fail("Unexpected end of formula");
+    char c = text[pos];
+    if (accept('('))
+    {
+      comparison();
+      if (!accept(')'))
+        fail("Missing ')'");
+      return;
+    }
+    if (c == '"')
+      return stringLiteral();
+    if (isDigit(c) || c == '.')
+      return number();
+    if (text.substr(pos).starts_with("#REF!"))
+    {
+      pos += 5;
+      return builder.valBrokenReference();
+    }
+
+    size_t start = pos;
+    std::string_view first = reference();
+    if (!first.empty())
+    {
+      skipSpace();
+      if (pos == text.size() || text[pos] != ':')
+        return builder.valReference(first);
+      ++pos;
+      skipSpace();
+      std::string_view second = reference();
+      if (second.empty())
+        fail("Invalid range");
+      if (first.data() + first.size() + 1 == second.data())
+        return builder.valRange(std::string_view(first.data(), first.size() + 1 + second.size()));
+      scratch.assign(first).append(":").append(second); // Spaces around ':' are dropped, as parseExpression does
+      return builder.valRange(std::string_view(scratch));
+    }
+
+    pos = start;
+    while (pos < text.size() && isLetter(text[pos]))
+      ++pos;
+    std::string_view name = text.substr(start, pos - start);
+    if (name.empty() || !accept('('))
+      fail("Unexpected token");
+    int params = 0;
+    if (!accept(')'))
+    {
+      do
+      {
+        comparison();
+        ++params;
+      } while (accept(','));
+      if (!accept(')'))
+        fail("Missing ')'");
+    }
+    builder.funcCall(name, params);
+  }
+
+  void stringLiteral() // "" inside literal stands for one quote, only such literals are copied
+  {
+    size_t start = ++pos;
+    size_t close = text.find('"', pos);
+    while (close != std::string_view::npos && close + 1 < text.size() && text[close + 1] == '"')
+      close = text.find('"', close + 2);
+    if (close == std::string_view::npos)
+      fail("Unterminated string");
+    pos = close + 1;
+    std::string_view literal = text.substr(start, close - start);
+    if (literal.find('"') == std::string_view::npos)
+      return builder.valString(literal);
+    scratch.clear();
+    for (size_t i = 0; i < literal.size(); ++i)
+    {
+      scratch.push_back(literal[i]);
+      if (literal[i] == '"')
+        ++i;
+    }
+    builder.valString(std::string_view(scratch));
+  }
+
+  void number()
+  {
+    const char *begin = text.data() + pos;
+    double val = 0;
+    std::from_chars_result result = scan_formula_number(begin, text.data() + text.size(), val);
+    if (result.ec == std::errc::invalid_argument)
+      fail("Invalid number");
+    if (result.ec == std::errc::result_out_of_range) // strtod saturates instead, rare enough to copy
+      val = std::strtod(std::string(begin, result.ptr).c_str(), nullptr);
+    pos = result.ptr - text.data();
+    builder.valNumber(val);
+  }
+
+  std::string_view reference() // [$]letters[$]digits, empty view and position unchanged when there is none
+  {
+    size_t start = pos;
+    if (pos < text.size() && text[pos] == '$')
+      ++pos;
+    size_t letters = pos;
+    while (pos < text.size() && isLetter(text[pos]))
+      ++pos;
+    if (pos == letters)
+      return pos = start, std::string_view();
+    if (pos < text.size() && text[pos] == '$')
+      ++pos;
+    size_t digits = pos;
+    while (pos < text.size() && isDigit(text[pos]))
+      ++pos;
+    if (pos == digits)
+      return pos = start, std::string_view();
+    return text.substr(start, pos - start);
+  }
+
+  std::string_view text;
+  TBuilder &builder;
+  size_t pos = 0;
+  std::string scratch; // Only for unescaped string literals and ranges with spaces, reused
+};
+
+template <typename TBuilder>
+void parse_formula(std::string_view formula, TBuilder &builder) // In-tree replacement of parseExpression
+{
+  CFormulaParser<TBuilder>(formula, builder).parse();
+}
+
+std::errc parse_number(std::string_view text, double &value) // Accepts what std::stod accepts, reports errors like std::from_chars instead of throwing
+{ // Leading whitespace, sign, hexadecimal, inf and nan are taken, text after the longest valid prefix is ignored
+  const char *cur = text.data(), *end = text.data() + text.size();
+  while (cur < end && std::isspace((unsigned char)*cur))
+    ++cur;
+  bool negative = cur < end && *cur == '-';
+  if (cur < end && (*cur == '+' || *cur == '-'))
+    ++cur;
+  if (cur == end || *cur == '+' || *cur == '-')
+    return std::errc::invalid_argument;
+
+  std::from_chars_result result{cur, std::errc::invalid_argument};
+  if (end - cur > 2 && cur[0] == '0' && (cur[1] == 'x' || cur[1] == 'X'))
+    result = std::from_chars(cur + 2, end, value, std::chars_format::hex);
+  if (result.ec == std::errc::invalid_argument) // Also "0x" without digits, which reads as 0
+    result = std::from_chars(cur, end, value);
+  if (result.ec != std::errc())
+    return result.ec;
+  if (std::fpclassify(value) == FP_SUBNORMAL)
+    return std::errc::result_out_of_range; // std::stod rejects these too
+  if (negative)
+    value = -value;
+  return std::errc();
+}
+
+struct CShift // Rows (or columns) inserted before index at when count > 0, deleted from at on when count < 0
+{
+  bool rows;
+  unsigned int at;
+  int count;
+  bool moves(int64_t row, int64_t column) const { return (rows ? row : column) >= at; }
+  bool apply(int64_t &row, int64_t &column) const // Position after the shift, false when it was deleted or pushed off the sheet
+  {
+    int64_t &index = rows ? row : column;
+    if (index < at)
+      return true;
+    if (index < int64_t(at) - std::min(count, 0))
+      return false;
+    index += count;
+    return index <= INT_MAX;
+  }
+};
+
 class CCell
 {
 public:
@@ -461,162 +915,154 @@ public:
   {
     NUMERIC,
     TEXT,
-    FORMULA
+    FORMULA,
+    EMPTY // Cleared cell, hides cell of mapped snapshot or spilled tile
   };
   CCell();
-  CCell(const std::string &value);
-  void extractCellReferences(const std::string &formula);
+  CCell(std::string_view value, bool deferParsing = false);
   void Set(const std::string &text);
   void Clear();
-  CValue getValue(CSpreadsheet *spreadsheet) const;
-  type get_type();
+  CEvalValue getValue(CSpreadsheet *spreadsheet) const;
+  type get_type() const;
+  static CCell restore(type contentType, std::string source, double number, std::string_view program);
+  static std::errc parse(std::string_view value, CCell &cell, bool deferParsing = false, CStringPool *strings = nullptr);
+  static CCell relocated(std::string_view value, std::shared_ptr<const std::string> program, int rowShift, int columnShift);
+  std::optional<CCell> moved(int rowShift, int columnShift) const;
+  bool shiftReferences(const CShift &shift);
   std::string getContent() const;
-  expBuilder formula; //->this will be parsed
+  const std::vector<uint64_t> &getReferences() const;
+  ExprPtr getExpression() const;
+  mutable expBuilder formula; //->this will be parsed
   std::string content_editor(int deltaColum, int deltaRow);
-  std::set<std::string> references;
 
 private:
+  friend class CParseCache;
+  void parseFormula() const;
+  void compile() const;
+  mutable bool pending_parse = false; // Formula text is kept raw until first use
+  mutable std::shared_ptr<const std::string> program; // Postfix program shared with copies, relative references move by program_rows/columns
+  int program_rows = 0, program_columns = 0;
+  mutable bool pending_program = false; // Expression is built from program on first use
   bool is_cyclic = false;
-  type content_type;
-  CValue content;
-  std::string original_content;
+  type content_type = EMPTY;
+  CEvalValue content;
+  mutable std::string original_content; // Empty for TEXT, whose content holds the text
+  mutable int text_rows = 0, text_columns = 0; // Shift of relative references not yet applied to original_content
 };
 
-void CCell::extractCellReferences(const std::string &formula)  // Extracts references from string declaring formula/expression that has references to another cells
+CCell::type CCell::get_type() const {
+  return this->content_type;
+} ;
+CCell::CCell(){};
+CCell::CCell(std::string_view value, bool deferParsing)
 {
-  int i = 0, len = formula.length();
+  std::errc ec = parse(value, *this, deferParsing);
+  if (ec == std::errc::result_out_of_range)
+    throw std::out_of_range("Number out of range: " + original_content);
+  if (ec != std::errc())
+    throw std::invalid_argument("Invalid formula: " + original_content);
+}
 
-  while (i < len)
+std::errc CCell::parse(std::string_view value, CCell &cell, bool deferParsing, CStringPool *strings) // Classifies contents without exceptions, cell is valid only on success
+{ // invalid_argument for formula that does not parse, result_out_of_range for number std::stod would reject. Texts are interned in strings when given
+  cell = CCell();
+  cell.original_content = value;
+  if (!value.empty() && value[0] == '=')
   {
-    if (std::isalpha(formula[i]))
+    cell.content_type = type::FORMULA;
+    cell.pending_parse = deferParsing;
+    if (deferParsing)
+      return std::errc();
+    try
     {
-      std::string colPart, rowPart;
-      bool columnComplete = false;
-      if (i > 0 && formula[i - 1] == '$')
-      {
-        i++;
-      }
-      while (i < len && std::isalpha(formula[i]))
-      {
-        colPart += std::toupper(formula[i]);
-        i++;
-        columnComplete = true;
-      }
-
-      if (i < len && formula[i] == '$' && columnComplete)
-      {
-        i++;
-      }
-
-      while (i < len && std::isdigit(formula[i]))
-      {
-        rowPart += formula[i];
-        i++;
-      }
-
-      if (!colPart.empty() && !rowPart.empty())
-      {
-        references.insert(colPart + rowPart);
-      }
+      cell.parseFormula();
     }
-    else
+    catch (...)
     {
-      i++;
+      return std::errc::invalid_argument; // Formula parser reports errors by throwing
     }
+    return std::errc();
   }
-}
 
-std::string CCell::getContent()const{
-  return original_content;
-};
-
-std::string updateFormula(std::string formula, int deltaRow, int deltaCol) { // Updates refernces in a string declaring calculation formula
-    std::string result;
-    int i = 0;
-    int len = formula.length();
-    if(formula.find("\"")!=std::string::npos) return formula;
-    while (i < len) {
-        if (std::isalpha(formula[i])) { 
-            bool absCol = false, absRow = false;
-            std::string colPart, rowPart;
-
-            if (i > 0 && formula[i-1] == '$') {
-                absCol = true; 
-                result.pop_back(); 
-            }
-
-            while (i < len && std::isalpha(formula[i])) {
-                colPart += formula[i++];
-            }
-
-            if (i < len && formula[i] == '$') {
-                absRow = true;
-                i++; 
-            }
-
-            while (i < len && std::isdigit(formula[i])) {
-                rowPart += formula[i++];
-            }
-
-            int colIndex = 0;
-            for (char c : colPart) {
-                colIndex = colIndex * 26 + (toupper(c) - 'A' + 1);
-            }
-
-            if (!absCol) {
-                colIndex += deltaCol;
-            }
+  double number;
+  std::errc ec = parse_number(value, number);
+  if (ec == std::errc())
+  {
+    cell.content = number;
+    cell.content_type = type::NUMERIC;
+  }
+  else if (ec == std::errc::invalid_argument)
+  {
+    cell.content = strings ? strings->intern(value) : CText(std::move(cell.original_content));
+    cell.original_content.clear();
+    cell.content_type = type::TEXT;
+    ec = std::errc();
+  }
+  return ec;
+}
 
-            std::string newColPart;
-            while (colIndex > 0) {
-                colIndex--;
-                newColPart = char('A' + (colIndex % 26)) + newColPart;
-                colIndex /= 26;
-            }
+CCell CCell::relocated(std::string_view value, std::shared_ptr<const std::string> program, int rowShift, int columnShift)
+{ // Relative references of program move by the shifts, see replay_program
+  CCell cell;
+  cell.content_type = FORMULA;
+  cell.original_content = value;
+  cell.program = std::move(program);
+  cell.program_rows = rowShift;
+  cell.program_columns = columnShift;
+  cell.pending_program = true;
+  return cell;
+}
 
-            int rowIndex = std::stoi(rowPart);
-            if (!absRow) {
-                rowIndex += deltaRow;
-            }
+void CCell::parseFormula() const
+{
+  parse_formula(original_content, formula);
+  formula.sortReferences();
+}
 
-            result += (absCol ? "$" : "") + newColPart + (absRow ? "$" : "") + std::to_string(rowIndex);
-        } else {
-            result += formula[i++];
-        }
+ExprPtr CCell::getExpression() const // Compiled formula, nullptr when deferred text turned out not to be valid formula
+{
+  if (pending_parse)
+  {
+    pending_parse = false;
+    try
+    {
+      parseFormula();
     }
-
-    return result;
-}
-CCell::type CCell::get_type(){
-  return this->content_type;
-} ;
-CCell::CCell(){};
-CCell::CCell(const std::string& value)  {
-    if (value[0] == '=') {
-        parseExpression(value, formula);
-        extractCellReferences(value);
-        content_type = type::FORMULA;
-    }
-    else {
-        try {
-            double numericValue = std::stod(value);
-            content = numericValue;
-            content_type = type::NUMERIC;
-        }
-        catch (const std::invalid_argument&) {
-            content = std::string(value);
-            content_type = type::TEXT;
-        }
+    catch (...)
+    {
+      formula = expBuilder();
+    }
+  }
+  if (pending_program)
+  {
+    pending_program = false;
+    try
+    {
+      replay_program(*program, formula, program_rows, program_columns);
+      formula.sortReferences();
     }
-    original_content = value;
+    catch (...)
+    {
+      formula = expBuilder();
+    }
+  }
+  return formula.exprStack.empty() ? nullptr : formula.getResult();
+}
+
+const std::vector<uint64_t> &CCell::getReferences() const // Packed positions of referenced cells, sorted, each once
+{
+  getExpression();
+  return formula.references;
 }
-CValue CCell::getValue(CSpreadsheet *spreadsheet) const
+
+CEvalValue CCell::getValue(CSpreadsheet *spreadsheet) const
 {
   if (content_type == FORMULA)
   {
-    auto result = formula.getResult()->eval(spreadsheet);
-    CValue A = CValue(result);
-    return A;
+    ExprPtr expression = getExpression();
+    if (!expression)
+      return CEvalValue();
+    return expression->eval(spreadsheet);
   }
   else if (content_type == NUMERIC)
   {
@@ -626,12 +1072,11 @@ CValue CCell::getValue(CSpreadsheet *spreadsheet) const
   }
   else if (content_type == TEXT)
   {
-    std::string textValue = std::get<std::string>(content);
-    return textValue;
+    return content; // Shares the text
   }
   else if (content.index() == 0)
   {
-    return CValue(); 
+    return CEvalValue(); 
   }
   else
   {
@@ -644,6 +1089,8 @@ class CPos
 {
 public:
   CPos(std::string_view str);
+  CPos(unsigned int row, unsigned int column);
+  CPos(unsigned int row, unsigned int column, bool relative_column, bool relative_row, std::string_view code);
   friend std::pair<int, int> CPos_parser(std::string_view str);
   bool operator<(const CPos &other) const;
   CPos offset(int dx, int dy) const;
@@ -651,6 +1098,7 @@ public:
   std::string getCode() const;
   std::pair<unsigned int, unsigned int> getRaC() const;
   std::pair<int, int> CPos_parser(std::string_view str);
+  static std::optional<CPos> fromCode(std::string_view str);
   CPos copy();
 
   mutable unsigned int row;
@@ -679,17 +1127,11 @@ std::string CPos::getCode() const{
   return code;
 }
 
-std::pair<int, int> CPos::CPos_parser(std::string_view str) //Parses string declaration of cell to numeric representation
+bool parse_cell_code(std::string_view str, int &row, int &column, bool &absolute_column, bool &absolute_row) // Non-throwing core of CPos_parser
 {
-  std::pair<int, int> position;
-  int column = 0;
-  int row = 0;
   size_t index = 0;
-  bool absolute_column = false;
-  bool absolute_row = false;
-
-  bool column_exists = false;
-  bool row_exists = false;
+  column = 0;
+  absolute_column = absolute_row = false;
 
   if (!str.empty() && str[index] == '$')
   {
@@ -697,56 +1139,82 @@ std::pair<int, int> CPos::CPos_parser(std::string_view str) //Parses string decl
     index++;
   }
 
-  while (index < str.size() && std::isalpha(str[index]))
+  bool column_exists = false;
+  while (index < str.size() && std::isalpha((unsigned char)str[index]))
   {
-    column = column * 26 + (std::tolower(str[index]) - 'a' + 1);
+    int digit = std::tolower((unsigned char)str[index]) - 'a' + 1;
+    if (column > (INT_MAX - digit) / 26)
+      return false; // Past column INT_MAX, FXSHRXW
+    column = column * 26 + digit;
     ++index;
     column_exists = true;
   }
+  if (!column_exists)
+    return false;
 
-  if (index < str.size() && str[index] == '$' && column_exists)
+  if (index < str.size() && str[index] == '$')
   {
     absolute_row = true;
     index++;
   }
 
-  if (index < str.size() && column_exists)
-  {
-    size_t processed_length = 0;
-    std::string row_part = std::string(str.substr(index));
-    row = std::stoi(row_part, &processed_length);
-    if (processed_length != row_part.length())
-    {
-      throw std::invalid_argument("Invalid row format in input: " + std::string(str));
-    }
-    row_exists = true;
-  }
+  // Row takes what std::stoi takes: leading whitespace and sign, but nothing after the digits
+  const char *cur = str.data() + index, *end = str.data() + str.size();
+  while (cur < end && std::isspace((unsigned char)*cur))
+    ++cur;
+  if (cur < end && *cur == '+' && end - cur > 1 && cur[1] != '-')
+    ++cur;
+  auto [parsed, ec] = std::from_chars(cur, end, row);
+  return ec == std::errc() && parsed == end;
+}
 
-  if (row_exists && column_exists)
-  {
-    position.first = row;
-    position.second = column;
-    relative_column = !absolute_column;
-    relative_row = !absolute_row;
-    return position;
-  }
-  else
-    throw std::invalid_argument("");
+std::pair<int, int> CPos::CPos_parser(std::string_view str) //Parses string declaration of cell to numeric representation
+{
+  int row, column;
+  bool absolute_column, absolute_row;
+  if (!parse_cell_code(str, row, column, absolute_column, absolute_row))
+    throw std::invalid_argument("Invalid cell position: " + std::string(str));
+  relative_column = !absolute_column;
+  relative_row = !absolute_row;
+  return {row, column};
 }
 
-std::string back_to_code(unsigned int row, unsigned int column) // Parses numeric represntation of position into original string representation
-{ 
-  std::string columnLabel;
+std::optional<CPos> CPos::fromCode(std::string_view str) // Same as CPos(str), but reports invalid code by returning nothing
+{
+  int row, column;
+  bool absolute_column, absolute_row;
+  if (!parse_cell_code(str, row, column, absolute_column, absolute_row))
+    return std::nullopt;
+  CPos pos(unsigned(row), unsigned(column), !absolute_column, !absolute_row, str);
+  return pos;
+}
 
+std::string back_to_code(unsigned int row, unsigned int column, bool absoluteColumn = false, bool absoluteRow = false) // Parses numeric represntation of position into original string representation
+{ // Built in a buffer, codes fit the short string storage and need no allocation. Absolute parts get their '$'
+  char buffer[24];
+  char *letters = buffer + 8; // Column letters are written backwards, at most 7 for unsigned column
+  char *begin = letters;
   while (column > 0)
   {
-    int remainder = (column - 1) % 26;
-    char letter = 'A' + remainder;
-    columnLabel = letter + columnLabel;
+    *--begin = char('A' + (column - 1) % 26);
     column = (column - 1) / 26;
   }
-  std::string rowLabel = std::to_string(row);
-  return columnLabel + rowLabel;
+  if (absoluteColumn)
+    *--begin = '$';
+  if (absoluteRow)
+    *letters++ = '$';
+  char *end = std::to_chars(letters, buffer + sizeof(buffer), row).ptr;
+  return std::string(begin, end);
+}
+
+CPos::CPos(unsigned int row, unsigned int column) // Builds position straight from numeric representation, without parsing
+    : row(row), column(column), relative_column(true), relative_row(true), code(back_to_code(row, column))
+{
+}
+
+CPos::CPos(unsigned int row, unsigned int column, bool relative_column, bool relative_row, std::string_view code)
+    : row(row), column(column), relative_column(relative_column), relative_row(relative_row), code(code)
+{
 }
 
 bool CPos::operator<( const CPos & other ) const {
@@ -760,522 +1228,4738 @@ CPos CPos::offset(int dx, int dy) const {    // Generate a new code for the new
 }
 //------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-class CSpreadsheet
+/* Binary snapshot layout, all integers little-endian, sections padded to 8 bytes:
+ *   header     magic "CSSB", u32 version, u64 string count, u64 string bytes, u64 program bytes, u64 cell count,
+ *              since version 2 also u32 flags and u32 reserved
+ *   strings    (count + 1) x u64 offsets into string bytes, then the bytes; equal strings are stored once
+ *   programs   u32 length + postfix program (ExprOp) per distinct formula source
+ *   cells      24 byte records sorted by position: u32 row, u32 column, u32 type, u32 string id, u64 payload
+ *              NUMERIC payload is the double, string id is its source text unless it equals number_to_text
+ *              TEXT    string id is the text
+ *              FORMULA string id is the source text, payload is offset of the program
+ *              with FLAG_COMPRESSED replaced by u64 stream bytes and the records encoded by compress_cells
+ *   values     only with FLAG_VALUES, 16 byte record per cell with its value at save time:
+ *              u32 kind (0 empty, 1 number, 2 text), u32 string id of text, u64 number
+ *   trailer    since version 3 u32 CRC32C per BLOCK_SIZE block of everything before the trailer, then u32 block count,
+ *              versions 1 and 2 had single u32 FNV-1a checksum of everything before it
+ */
+class CSnapshotView // Read-only access to binary snapshot bytes, validated once in open
 {
 public:
-  static unsigned capabilities()
-  {
-    return SPREADSHEET_CYCLIC_DEPS;
-  }
-  CSpreadsheet(){};
-  bool load(std::istream &is);
-  bool save(std::ostream &os) const;
-  bool setCell(CPos pos, std::string contents);
-  bool dfsCycleCheck(const CPos &pos, std::map<CPos, int> &state);
-  CValue getValue(CPos pos);
-  void copyRect(CPos dst, CPos src, int w = 1, int h = 1);
-  std::map<CPos, CCell> page; 
+  static constexpr char MAGIC[4] = {'C', 'S', 'S', 'B'};
+  static constexpr uint32_t VERSION = 3;
+  static constexpr uint32_t NO_STRING = UINT32_MAX;
+  static constexpr uint32_t FLAG_VALUES = 0x01;
+  static constexpr uint32_t FLAG_COMPRESSED = 0x02;
+  static constexpr size_t HEADER_SIZE = 48;
+  static constexpr size_t RECORD_SIZE = 24;
+  static constexpr size_t VALUE_SIZE = 16;
+  static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+  static uint32_t checksum(std::string_view data);
+  static void seal(std::string &data);
+  static size_t unsealed(std::string_view data);
+  static size_t padded(size_t size) { return (size + 7) & ~size_t(7); }
+
+  bool open(std::string_view data);
+  uint64_t cellCount() const { return m_cellCount; }
+  unsigned int row(uint64_t index) const { return get_le<uint32_t>(record(index)); }
+  unsigned int column(uint64_t index) const { return get_le<uint32_t>(record(index) + 4); }
+  uint32_t type(uint64_t index) const { return get_le<uint32_t>(record(index) + 8); }
+  double number(uint64_t index) const { return get_double(record(index) + 16); }
+  std::string_view text(uint64_t index) const { return string(get_le<uint32_t>(record(index) + 12)); }
+  uint64_t lowerBound(unsigned int row, unsigned int column) const;
+  std::optional<uint64_t> find(unsigned int row, unsigned int column) const;
+  CCell cell(uint64_t index) const;
+  bool hasValues() const { return m_values != nullptr; }
+  CEvalValue value(uint64_t index) const;
+  std::string_view string(uint32_t id) const;
+  std::string_view program(uint64_t offset) const;
+
+private:
+  const char *record(uint64_t index) const { return m_cells + index * RECORD_SIZE; }
+
+  const char *m_offsets = nullptr;
+  const char *m_strings = nullptr;
+  const char *m_programs = nullptr;
+  const char *m_cells = nullptr;
+  const char *m_values = nullptr;
+  std::shared_ptr<const std::string> m_expanded; // Decoded records of compressed snapshot, shared by copies of the view
+  uint64_t m_stringCount = 0, m_stringBytes = 0, m_programBytes = 0, m_cellCount = 0;
 };
 
-bool CSpreadsheet::dfsCycleCheck(const CPos &pos, std::map<CPos, int> &state)
+class CBitWriter // Appends bits to the string, most significant first
 {
-  if (state[pos] == 1)
-    return true; // Cycle found, this cell is already being visited
-  if (state[pos] == 2)
-    return false; // Already fully processed this cell
-
-  state[pos] = 1;
-  CCell &cell = page[pos];
-  if (cell.get_type() == CCell::type::FORMULA)
+public:
+  explicit CBitWriter(std::string &out) : m_out(out) {}
+  void put(uint64_t bits, unsigned int count) // Lowest count bits of value, count up to 64
   {
-    for (const auto &refStr : cell.references)
+    while (count > 0)
     {
-      CPos refPos(refStr);
-      if (page.find(refPos) != page.end() && dfsCycleCheck(refPos, state))
+      unsigned int take = std::min(count, 8u);
+      count -= take;
+      m_pending = (m_pending << take) | ((bits >> count) & ((1u << take) - 1));
+      m_used += take;
+      if (m_used >= 8)
       {
-        return true;
+        m_used -= 8;
+        m_out.push_back(char(m_pending >> m_used));
+        m_pending &= (1u << m_used) - 1;
       }
     }
   }
-  state[pos] = 2;
-  return false;
-}
-
-CValue CSpreadsheet::getValue(CPos pos)
-{
-  std::map<CPos, int> state;
-  if (page.find(pos) != page.end() && !dfsCycleCheck(pos, state))
-    return page[pos].getValue(this);
-  return CValue();
-};
-
-bool CSpreadsheet::setCell(CPos pos, std::string contents)
-{
-  CCell tmp;
-
-  try
+  void putVarint(uint64_t value) // 7 bit groups, each preceded by a continuation bit
   {
-    tmp = CCell(contents);
+    do
+    {
+      uint64_t low = value & 0x7f;
+      value >>= 7;
+      put(value != 0, 1);
+      put(low, 7);
+    } while (value != 0);
   }
-  catch (...)
+  void finish()
   {
-    return false; // Return false if the cell contents are invalid
+    if (m_used > 0)
+      m_out.push_back(char(m_pending << (8 - m_used)));
+    m_pending = m_used = 0;
   }
-  page[pos] = tmp;
-  return true; 
-}
 
-bool CSpreadsheet::save(std::ostream &os) const
+private:
+  std::string &m_out;
+  uint32_t m_pending = 0;
+  unsigned int m_used = 0;
+};
+
+class CBitReader // Reads bits written by CBitWriter, throws std::invalid_argument past the end
 {
-  for (const auto &entry : page)
+public:
+  explicit CBitReader(std::string_view data) : m_data(data) {}
+  uint64_t get(unsigned int count)
   {
-    const auto &pos = entry.first;   // CPos object
-    const auto &cell = entry.second; // CCell object
-
-    std::string encodedContent = cell.getContent();
-
-    os << "BUNK" << pos.getCode() << "CONT" << encodedContent << char(31); 
-    if (!os)
+    if (count > (m_data.size() - m_byte) * 8 - m_bit)
+      throw std::invalid_argument("Truncated bit stream");
+    uint64_t value = 0;
+    while (count > 0)
     {
-      std::cerr << "Error writing to output stream." << std::endl;
-      return false;
+      unsigned int available = 8 - m_bit, take = std::min(count, available);
+      uint64_t byte = (unsigned char)m_data[m_byte];
+      value = (value << take) | ((byte >> (available - take)) & ((1u << take) - 1));
+      count -= take;
+      m_bit += take;
+      if (m_bit == 8)
+      {
+        m_bit = 0;
+        ++m_byte;
+      }
     }
+    return value;
   }
-  return true;
-}
-
-bool CSpreadsheet::load(std::istream &is)
-{
-  std::string line;
-  while (getline(is, line, char(31)))
+  uint64_t getVarint()
   {
-    if (line.empty())
-      continue; 
-    size_t bunkPos = line.find("BUNK");
-    size_t contPos = line.find("CONT");
-    if (bunkPos == std::string::npos || contPos == std::string::npos || bunkPos > contPos)
+    uint64_t value = 0;
+    for (unsigned int shift = 0;; shift += 7)
     {
-      std::cerr << "Error: Invalid line format. Line: " << line << std::endl;
-      return false;
+      bool more = get(1);
+      uint64_t low = get(7);
+      if (shift >= 64 || (shift == 63 && low > 1))
+        throw std::invalid_argument("Varint too long");
+      value |= low << shift;
+      if (!more)
+        return value;
     }
+  }
 
-    std::string cellPos = line.substr(bunkPos + 4, contPos - (bunkPos + 4));
-    std::string contents = line.substr(contPos + 4);
+private:
+  std::string_view m_data;
+  size_t m_byte = 0;
+  unsigned int m_bit = 0;
+};
 
-    CPos posObject(cellPos);
-    if (!setCell(posObject, contents))
-    {
-      std::cerr << "Error setting cell at position " << cellPos << " with content " << contents << std::endl;
-      return false;
-    }
-  }
-  return true;
-}
+struct CCellRecord // Fields of one 24 byte snapshot cell record
+{
+  uint32_t row, column, type, stringId;
+  uint64_t payload;
+};
 
-void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h)
+/* Column-wise encoding of snapshot cell records, cells of one column follow each other in increasing row order:
+ *   column   varint column difference from previous column, varint cell count
+ *   cell     row        varint for first cell of column, then delta-of-delta of rows, zigzag coded:
+ *                       '0' no change, '10' 7 bits, '110' 12 bits, '1110' 20 bits, '1111' 64 bits
+ *            type       '0' NUMERIC, '10' TEXT, '11' FORMULA
+ *            NUMERIC    '0' without source string or '1' + varint string id, then the double XOR previous
+ *                       number of the column: '0' equal, '10' meaningful bits in previous window,
+ *                       '11' 5 bits leading zeros, 6 bits length - 1, meaningful bits
+ *            TEXT       varint string id
+ *            FORMULA    varint string id, varint program offset
+ * Time series columns with constant row step and slowly changing values take few bits per cell.
+ */
+std::string compress_cells(std::string_view records, uint64_t count)
 {
-  int deltaRow = dst.getRaC().first - src.getRaC().first;
-  int deltaCol = dst.getRaC().second - src.getRaC().second;
+  std::vector<CCellRecord> cells(count);
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    const char *rec = records.data() + i * 24;
+    cells[i] = {get_le<uint32_t>(rec), get_le<uint32_t>(rec + 4), get_le<uint32_t>(rec + 8), get_le<uint32_t>(rec + 12), get_le<uint64_t>(rec + 16)};
+  }
+  std::stable_sort(cells.begin(), cells.end(), [](const CCellRecord &a, const CCellRecord &b)
+                   { return a.column < b.column; });
 
-  std::map<CPos, CCell> tmpCells;
-  for (int row = 0; row < h; ++row)
+  std::string out;
+  CBitWriter bits(out);
+  uint32_t previousColumn = 0;
+  for (size_t begin = 0, end; begin < cells.size(); begin = end)
   {
-    for (int col = 0; col < w; ++col)
+    for (end = begin; end < cells.size() && cells[end].column == cells[begin].column; ++end)
+      ;
+    bits.putVarint(cells[begin].column - previousColumn);
+    bits.putVarint(end - begin);
+    previousColumn = cells[begin].column;
+
+    int64_t previousRow = 0, previousDelta = 0;
+    uint64_t previousNumber = 0;
+    unsigned int leading = 0, trailing = 0;
+    bool window = false;
+    for (size_t i = begin; i < end; ++i)
     {
-      CPos currentSrc = src.offset(col, row);
-      CPos currentDst = dst.offset(col, row);
+      const CCellRecord &cell = cells[i];
+      if (i == begin)
+        bits.putVarint(cell.row);
+      else
+      {
+        int64_t delta = int64_t(cell.row) - previousRow, change = delta - previousDelta;
+        uint64_t zigzag = (uint64_t(change) << 1) ^ uint64_t(change >> 63);
+        if (zigzag == 0)
+          bits.put(0, 1);
+        else if (zigzag < (1u << 7))
+          bits.put((0b10u << 7) | zigzag, 9);
+        else if (zigzag < (1u << 12))
+          bits.put((0b110u << 12) | zigzag, 15);
+        else if (zigzag < (1u << 20))
+          bits.put((0b1110u << 20) | zigzag, 24);
+        else
+        {
+          bits.put(0b1111, 4);
+          bits.put(zigzag, 64);
+        }
+        previousDelta = delta;
+      }
+      previousRow = cell.row;
 
-      if (page.find(currentSrc) != page.end())
+      if (cell.type == CCell::NUMERIC)
       {
-        if (page[currentSrc].get_type() == CCell::type::FORMULA)
+        bits.put(0, 1);
+        if (cell.stringId == CSnapshotView::NO_STRING)
+          bits.put(0, 1);
+        else
         {
-          CCell srcCell(updateFormula(page[currentSrc].getContent(), deltaRow, deltaCol));
-          tmpCells[currentDst] = srcCell;
+          bits.put(1, 1);
+          bits.putVarint(cell.stringId);
         }
-        else if ((page[currentSrc].get_type() == CCell::type::TEXT) || (page[currentSrc].get_type() == CCell::type::NUMERIC))
+        uint64_t x = cell.payload ^ previousNumber;
+        previousNumber = cell.payload;
+        if (x == 0)
         {
-          CCell srcCell(page[currentSrc].getContent());
-          tmpCells[currentDst] = srcCell;
+          bits.put(0, 1);
+          continue;
         }
-        else
+        unsigned int lead = std::min(std::countl_zero(x), 31), trail = std::countr_zero(x);
+        if (window && lead >= leading && trail >= trailing)
         {
-          CCell srcCell(page[currentSrc].getContent());
-          tmpCells[currentDst] = srcCell;
+          bits.put(0b10, 2);
+          bits.put(x >> trailing, 64 - leading - trailing);
+          continue;
         }
+        leading = lead;
+        trailing = trail;
+        window = true;
+        bits.put(0b11, 2);
+        bits.put(leading, 5);
+        bits.put(63 - leading - trailing, 6);
+        bits.put(x >> trailing, 64 - leading - trailing);
       }
-      else if (page.find(currentDst) != page.end() && page.find(currentSrc) == page.end())
+      else
       {
-        tmpCells[currentDst]=CCell();
+        bits.put(cell.type == CCell::TEXT ? 0b10 : 0b11, 2);
+        bits.putVarint(cell.stringId);
+        if (cell.type == CCell::FORMULA)
+          bits.putVarint(cell.payload);
       }
-  
     }
   }
+  bits.finish();
+  return out;
+}
+
+bool expand_cells(std::string_view stream, uint64_t count, std::string &records) // Decodes compress_cells back to records sorted by position
+{
+  std::vector<CCellRecord> cells;
+  cells.reserve(count);
+  try
+  {
+    CBitReader bits(stream);
+    uint64_t column = 0;
+    while (cells.size() < count)
+    {
+      uint64_t columnDelta = bits.getVarint(), columnCount = bits.getVarint();
+      if ((columnDelta == 0 && !cells.empty()) || columnDelta > UINT32_MAX || (column += columnDelta) > UINT32_MAX || columnCount == 0 || columnCount > count - cells.size())
+        return false;
+
+      int64_t row = 0, delta = 0;
+      uint64_t number = 0;
+      unsigned int leading = 0, trailing = 0;
+      bool window = false;
+      for (uint64_t i = 0; i < columnCount; ++i)
+      {
+        if (i == 0)
+        {
+          uint64_t first = bits.getVarint();
+          if (first > UINT32_MAX)
+            return false;
+          row = int64_t(first);
+        }
+        else
+        {
+          uint64_t zigzag = 0;
+          if (bits.get(1) == 0)
+            zigzag = 0;
+          else if (bits.get(1) == 0)
+            zigzag = bits.get(7);
+          else if (bits.get(1) == 0)
+            zigzag = bits.get(12);
+          else if (bits.get(1) == 0)
+            zigzag = bits.get(20);
+          else
+            zigzag = bits.get(64);
+          delta = int64_t(uint64_t(delta) + ((zigzag >> 1) ^ (0 - (zigzag & 1))));
+          if (delta <= 0 || delta > UINT32_MAX)
+            return false; // Rows of a column must increase
+          if ((row += delta) > UINT32_MAX)
+            return false;
+        }
 
-  for(const auto & [pos,cell]:tmpCells){
-    page[pos] = cell;
+        CCellRecord cell{uint32_t(row), uint32_t(column), CCell::NUMERIC, CSnapshotView::NO_STRING, 0};
+        if (bits.get(1) == 0)
+        {
+          if (bits.get(1) == 1 && (cell.stringId = uint32_t(bits.getVarint())) == CSnapshotView::NO_STRING)
+            return false;
+          if (bits.get(1) == 1)
+          {
+            if (bits.get(1) == 1)
+            {
+              leading = bits.get(5);
+              trailing = 63 - leading - std::min<unsigned int>(bits.get(6), 63 - leading);
+              window = true;
+            }
+            else if (!window)
+              return false;
+            number ^= bits.get(64 - leading - trailing) << trailing;
+          }
+          cell.payload = number;
+        }
+        else
+        {
+          cell.type = bits.get(1) == 0 ? CCell::TEXT : CCell::FORMULA;
+          cell.stringId = uint32_t(bits.getVarint());
+          if (cell.type == CCell::FORMULA)
+            cell.payload = bits.getVarint();
+        }
+        cells.push_back(cell);
+      }
+    }
+  }
+  catch (const std::invalid_argument &)
+  {
+    return false;
   }
 
+  std::sort(cells.begin(), cells.end(), [](const CCellRecord &a, const CCellRecord &b)
+            { return std::tie(a.row, a.column) < std::tie(b.row, b.column); });
+  records.clear();
+  records.reserve(count * 24);
+  for (const CCellRecord &cell : cells)
+  {
+    put_le<uint32_t>(records, cell.row);
+    put_le<uint32_t>(records, cell.column);
+    put_le<uint32_t>(records, cell.type);
+    put_le<uint32_t>(records, cell.stringId);
+    put_le<uint64_t>(records, cell.payload);
+  }
+  return true;
 }
-//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-class Reference : public Expr
+class CMappedFile // Read-only memory mapping of whole file, unmapped together with its last owner
 {
 public:
-  CPos pos;
+  static std::shared_ptr<const CMappedFile> open(const std::string &fileName);
+  CMappedFile(const CMappedFile &) = delete;
+  CMappedFile &operator=(const CMappedFile &) = delete;
+  ~CMappedFile();
+  std::string_view data() const { return m_data; }
 
-  Reference(CPos m_pos)
-      : pos(m_pos) {}
-  int getType() const override { return 1; }
-  CValue eval(CSpreadsheet *spreadsheet) const override
+private:
+  CMappedFile() = default;
+  std::string_view m_data;
+  std::string m_buffer; // File contents when mmap is not available
+};
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+template <typename TOnReference>
+bool rewrite_references(std::string_view formula, std::string &out, TOnReference onReference) // Copies formula to out, onReference writes each reference instead
+{ // References are found like CFormulaParser finds them, string literals and numbers are copied as they are
+  out.clear();
+  bool quoted = false;
+  for (size_t i = 0; i < formula.size();)
   {
-    if (spreadsheet->page.find(pos) == spreadsheet->page.end())
+    char c = formula[i];
+    if (c == '"' || quoted)
     {
-      return std::monostate();
+      quoted ^= c == '"'; // Escaped quote toggles twice
+      out.push_back(c);
+      ++i;
+      continue;
+    }
+    if ((c >= '0' && c <= '9') || c == '.')
+    { // Skipped whole, as the parser reads it, so exponents and hex digits are not taken for references
+      double value;
+      auto [end, ec] = scan_formula_number(formula.data() + i, formula.data() + formula.size(), value);
+      size_t length = ec == std::errc::invalid_argument ? 1 : end - (formula.data() + i);
+      out.append(formula.substr(i, length));
+      i += length;
+      continue;
     }
-    return spreadsheet->getValue(pos);
+    if (c != '$' && !std::isalpha((unsigned char)c))
+    {
+      out.push_back(c);
+      ++i;
+      continue;
+    }
+
+    size_t end = i + (c == '$'), letters = end; // [$]letters[$]digits, as CFormulaParser reads references
+    while (end < formula.size() && std::isalpha((unsigned char)formula[end]))
+      ++end;
+    size_t afterLetters = end;
+    if (end < formula.size() && formula[end] == '$')
+      ++end;
+    size_t digits = end;
+    while (end < formula.size() && std::isdigit((unsigned char)formula[end]))
+      ++end;
+    if (afterLetters == letters || end == digits)
+    { // Function name or stray '$'
+      size_t length = std::max<size_t>(afterLetters - i, 1);
+      out.append(formula.substr(i, length));
+      i += length;
+      continue;
+    }
+
+    int row, column;
+    bool absoluteColumn, absoluteRow;
+    if (!parse_cell_code(formula.substr(i, end - i), row, column, absoluteColumn, absoluteRow) ||
+        !onReference(row, column, absoluteColumn, absoluteRow))
+      return false;
+    i = end;
   }
-};
+  return true;
+}
 
-void expBuilder::valReference(std::string val)
-{
-  CPos pos(val);
-  exprStack.push(std::make_shared<Reference>(pos));
+bool formula_key(std::string_view formula, unsigned int row, unsigned int column, std::string &key) // Formula text with references written relative to (row, column)
+{ // Formulas with equal keys compile to the same program up to the shift of relative references, false when the text cannot be keyed
+  if (formula.find_first_of("\x01\x02") != std::string_view::npos)
+    return false; // Would read as encoded reference
+  return rewrite_references(formula, key, [&](int refRow, int refColumn, bool absoluteColumn, bool absoluteRow)
+  {
+    char number[24];
+    key.push_back('\x01');
+    key.push_back(absoluteColumn ? 'C' : 'c');
+    key.append(number, std::to_chars(number, number + sizeof(number), absoluteColumn ? int64_t(refColumn) : int64_t(refColumn) - column).ptr);
+    key.push_back(absoluteRow ? 'R' : 'r');
+    key.append(number, std::to_chars(number, number + sizeof(number), absoluteRow ? int64_t(refRow) : int64_t(refRow) - row).ptr);
+    key.push_back('\x02');
+    return true;
+  });
 }
 
-//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool relocate_formula_text(std::string_view formula, int rowShift, int columnShift, std::string &out) // Moves relative references, false when one would leave the sheet
+{
+  return rewrite_references(formula, out, [&](int64_t row, int64_t column, bool absoluteColumn, bool absoluteRow)
+  {
+    row += absoluteRow ? 0 : rowShift;
+    column += absoluteColumn ? 0 : columnShift;
+    if (row < 0 || row > INT_MAX || column < 1 || column > INT_MAX)
+      return false;
+    out += back_to_code(unsigned(row), unsigned(column), absoluteColumn, absoluteRow);
+    return true;
+  });
+}
 
-//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-#ifndef __PROGTEST__
+template <typename TOnReference>
+bool visit_program_references(std::string_view program, TOnReference onReference) // Calls onReference(offset, row, column, flags) for each REFERENCE operand
+{ // False when the program is truncated or onReference returns false
+  for (size_t i = 0; i < program.size();)
+  {
+    switch (ExprOp(program[i++]))
+    {
+    case ExprOp::NUMBER:
+      i += 8;
+      break;
+    case ExprOp::TEXT:
+      i += 4 + (program.size() - i >= 4 ? get_le<uint32_t>(program.data() + i) : 0);
+      break;
+    case ExprOp::REFERENCE:
+    {
+      if (program.size() - i < 9)
+        return false;
+      size_t offset = i;
+      i += 9;
+      if (!onReference(offset, int64_t(get_le<uint32_t>(program.data() + offset)), int64_t(get_le<uint32_t>(program.data() + offset + 4)), uint8_t(program[offset + 8])))
+        return false;
+      break;
+    }
+    default:
+      break; // Operators have no operands in the program
+    }
+  }
+  return true;
+}
 
-bool                                   valueMatch                              ( const CValue                        & r,
-                                                                                 const CValue                        & s )
+bool program_fits(std::string_view program, int rowShift, int columnShift) // False when replay_program with the shifts would move a reference outside the sheet
+{
+  return visit_program_references(program, [&](size_t, int64_t row, int64_t column, uint8_t flags)
+  {
+    row += flags & 2 ? 0 : rowShift;
+    column += flags & 1 ? 0 : columnShift;
+    return row >= 0 && row <= INT_MAX && column >= 1 && column <= INT_MAX;
+  });
+}
 
+std::string CCell::getContent() const // Text of copied formula is rewritten here, on first request
 {
-  if ( r . index () != s . index () )
-    return false;
-  if ( r . index () == 0 )
-    return true;
-  if ( r . index () == 2 )
-    return std::get<std::string> ( r ) == std::get<std::string> ( s );
-  if ( std::isnan ( std::get<double> ( r ) ) && std::isnan ( std::get<double> ( s ) ) )
-    return true;
-  if ( std::isinf ( std::get<double> ( r ) ) && std::isinf ( std::get<double> ( s ) ) )
-    return ( std::get<double> ( r ) < 0 && std::get<double> ( s ) < 0 )
-           || ( std::get<double> ( r ) > 0 && std::get<double> ( s ) > 0 );
-  return fabs ( std::get<double> ( r ) - std::get<double> ( s ) ) <= 1e8 * DBL_EPSILON * fabs ( std::get<double> ( r ) );
+  if (content_type == TEXT)
+    return std::get<CText>(content).str();
+  if (text_rows != 0 || text_columns != 0)
+  {
+    std::string moved;
+    relocate_formula_text(original_content, text_rows, text_columns, moved); // moved() checked that references fit
+    original_content = std::move(moved);
+    text_rows = text_columns = 0;
+  }
+  return original_content;
 }
 
-//==============================================================================================================================
+std::optional<CCell> CCell::moved(int rowShift, int columnShift) const // Copy for cell shifted by the deltas, relative references follow without parsing
+{ // Nothing when a reference would leave the sheet
+  if (content_type != FORMULA || (rowShift == 0 && columnShift == 0))
+    return *this;
+  compile();
+
+  CCell cell;
+  cell.content_type = FORMULA;
+  if (!program)
+  { // Formula that does not compile, only its text moves
+    if (!relocate_formula_text(getContent(), rowShift, columnShift, cell.original_content))
+      return std::nullopt;
+    return cell;
+  }
+  if (!program_fits(*program, program_rows + rowShift, program_columns + columnShift))
+    return std::nullopt;
+  cell.program = program;
+  cell.program_rows = program_rows + rowShift;
+  cell.program_columns = program_columns + columnShift;
+  cell.pending_program = true;
+  cell.original_content = original_content;
+  cell.text_rows = text_rows + rowShift;
+  cell.text_columns = text_columns + columnShift;
+  return cell;
+}
 
+void CCell::compile() const // Serializes expression into program once, later copies and shifts share it
+{
+  if (program || !getExpression())
+    return;
+  auto compiled = std::make_shared<std::string>();
+  getExpression()->serialize(*compiled);
+  program = std::move(compiled);
+}
 
+bool CCell::shiftReferences(const CShift &shift) // Follows cells moved by inserted or deleted rows or columns, false when no reference moved
+{ // The program is patched instead of reparsing the text, references to deleted cells become #REF!, which reads as empty cell
+  if (content_type != FORMULA)
+    return false;
+  if (!pending_parse)
+    compile();
 
-//==============================================================================================================================
+  std::string patched;
+  if (program)
+  {
+    bool affected = false;
+    size_t copied = 0;
+    visit_program_references(*program, [&](size_t offset, int64_t row, int64_t column, uint8_t flags)
+    { // Written with the pending shift applied, the patched program is replayed unshifted
+      row += flags & 2 ? 0 : program_rows;
+      column += flags & 1 ? 0 : program_columns;
+      affected |= shift.moves(row, column);
+      patched.append(*program, copied, offset - copied); // Up to and including the opcode
+      copied = offset + 9;
+      if (!shift.apply(row, column))
+        patched.back() = char(ExprOp::BROKEN_REFERENCE);
+      else
+      {
+        put_le<uint32_t>(patched, uint32_t(row));
+        put_le<uint32_t>(patched, uint32_t(column));
+        patched.push_back(char(flags));
+      }
+      return true;
+    });
+    if (!affected)
+      return false;
+    patched.append(*program, copied);
+  }
 
+  std::string text;
+  bool affected = false;
+  if (!rewrite_references(original_content, text, [&](int64_t row, int64_t column, bool absoluteColumn, bool absoluteRow)
+                          { // Shift of a copy not yet applied to the text is applied in the same pass
+                            row += absoluteRow ? 0 : text_rows;
+                            column += absoluteColumn ? 0 : text_columns;
+                            affected |= shift.moves(row, column);
+                            if (shift.apply(row, column))
+                              text += back_to_code(unsigned(row), unsigned(column), absoluteColumn, absoluteRow);
+                            else
+                              text += "#REF!";
+                            return true;
+                          }) || !affected)
+    return false; // Text of broken formula keeps what cannot be read as references
+  original_content = std::move(text);
+  text_rows = text_columns = 0;
+  if (program)
+  {
+    formula = expBuilder();
+    program = std::make_shared<const std::string>(std::move(patched));
+    program_rows = program_columns = 0;
+    pending_program = true;
+  }
+  return true;
+}
+
+class CParseCache // Compiled formulas by formula_key, least recently used entries are dropped first. Literal texts are interned
+{
+public:
+  static constexpr size_t CAPACITY = 4096;
+
+  CParseCache() = default;
+  CParseCache(const CParseCache &) {} // Copies start empty, the index points into the owner's list
+  CParseCache &operator=(const CParseCache &)
+  {
+    clear();
+    return *this;
+  }
+
+  std::errc parse(std::string_view value, const CPos &pos, CCell &cell, bool deferParsing = false); // CCell::parse that compiles each distinct formula once
+  void clear()
+  {
+    m_index.clear();
+    m_entries.clear();
+  }
+  size_t size() const { return m_entries.size(); }
+
+private:
+  struct CEntry
+  {
+    std::string key;
+    std::shared_ptr<const std::string> program; // Postfix program compiled for the cell at (row, column)
+    unsigned int row, column;
+  };
+  std::list<CEntry> m_entries; // Most recently used first
+  std::unordered_map<std::string_view, std::list<CEntry>::iterator> m_index;
+  std::string m_key; // Reused so lookups do not allocate
+  CStringPool m_strings; // Texts of literal cells, equal ones share one string
+};
+
+std::errc CParseCache::parse(std::string_view value, const CPos &pos, CCell &cell, bool deferParsing)
+{
+  if (value.empty() || value[0] != '=')
+    return CCell::parse(value, cell, deferParsing, &m_strings);
+  if (!formula_key(value, pos.row, pos.column, m_key))
+    return CCell::parse(value, cell, deferParsing);
+
+  if (auto found = m_index.find(m_key); found != m_index.end())
+  {
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    const CEntry &entry = *found->second;
+    cell = CCell::relocated(value, entry.program, int(int64_t(pos.row) - entry.row), int(int64_t(pos.column) - entry.column));
+    return std::errc();
+  }
+  if (deferParsing)
+    return CCell::parse(value, cell, true); // Nothing compiled to remember
+
+  std::errc ec = CCell::parse(value, cell);
+  ExprPtr expression = ec == std::errc() ? cell.getExpression() : nullptr;
+  if (!expression)
+    return ec;
+  auto program = std::make_shared<std::string>();
+  expression->serialize(*program);
+  cell.program = program; // Copies of the cell share it too
+  m_entries.push_front({m_key, std::move(program), pos.row, pos.column});
+  m_index.emplace(m_entries.front().key, m_entries.begin());
+  if (m_entries.size() > CAPACITY)
+  {
+    m_index.erase(m_entries.back().key);
+    m_entries.pop_back();
+  }
+  return ec;
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+/* Out-of-core storage, see CSpreadsheet::enablePaging. Tiles are bands of TILE_ROWS whole rows, so each one is
+ * contiguous range of page. Tiles changed since they became resident are appended to the spill file when they leave
+ * page, later copies supersede earlier ones. Reads prefer page, then spill copy of the tile, then mapped snapshot.
+ * Spill record: u32 cell count, per cell u32 row, u32 column, u8 type, f64 number, u32 length + source text,
+ * u32 length + postfix program, then u32 CRC32C of the record.
+ */
+struct CTilePager
+{
+  static constexpr unsigned int TILE_ROWS = 64;
+  static constexpr size_t CELL_BYTES = sizeof(std::pair<const CPos, CCell>) + 96; // Node, allocator overhead and typical text
+  static constexpr size_t TILE_BYTES = 128;
+  struct CTile
+  {
+    uint64_t used;      // Position in lru
+    bool dirty = false; // Page holds changes the spill file does not have
+  };
+
+  bool read(uint32_t tile, std::vector<std::pair<CPos, CCell>> &cells) const;
+  bool write(uint32_t tile, std::map<CPos, CCell>::const_iterator first, std::map<CPos, CCell>::const_iterator last);
+
+  std::shared_ptr<std::fstream> spill; // Shared by copies of the sheet, written records never change
+  size_t budget = 0;                   // Bytes of resident cells, estimated with CELL_BYTES and TILE_BYTES
+  uint64_t clock = 0;
+  std::unordered_map<uint32_t, CTile> resident;
+  std::map<uint64_t, uint32_t> lru;                                     // Last use -> tile, least recently used first
+  std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>> spilled; // Tile -> offset and size of its latest copy
+};
+
+class CSpreadsheet
+{
+public:
+  static unsigned capabilities()
+  {
+    return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_PARSER;
+  }
+  CSpreadsheet(){};
+  bool load(std::istream &is);
+  bool loadParallel(std::istream &is, unsigned threads = 0);
+  void setLazyParsing(bool lazy) { m_lazyParsing = lazy; }
+  void setSnapshotCompression(bool compress) { m_compressSnapshots = compress; }
+  bool save(std::ostream &os) const;
+  bool loadBinary(std::istream &is);
+  bool saveBinary(std::ostream &os) const;
+  bool saveBinary(std::ostream &os, bool withValues);
+  bool loadMapped(const std::string &fileName);
+  bool importCSV(std::istream &is, CPos origin);
+  bool exportCSV(std::ostream &os, CPos topLeft, int w, int h);
+  bool enablePaging(const std::string &spillFileName, size_t memoryBudget);
+  bool setCell(CPos pos, std::string contents);
+  bool setCells(std::span<const std::pair<CPos, std::string>> cells);
+  bool dfsCycleCheck(const CPos &pos, std::map<CPos, int> &state);
+  CValue getValue(CPos pos);
+  std::vector<CValue> getValues(CPos topLeft, int w, int h);
+  void visitCells(CPos topLeft, int w, int h, const std::function<void(const CPos &, const CCell &)> &visitor, bool columnMajor = false) const;
+  void visitAllCells(const std::function<void(const CPos &, const CCell &)> &visitor) const;
+  void copyRect(CPos dst, CPos src, int w = 1, int h = 1);
+  bool fillDown(CPos src, int w, int h, int count);
+  bool fillRight(CPos src, int w, int h, int count);
+  bool fillSeries(CPos src, int w, int h, int count, double step, bool down = true);
+  bool insertRows(unsigned int row, int count = 1);
+  bool deleteRows(unsigned int row, int count = 1);
+  bool insertColumns(unsigned int column, int count = 1);
+  bool deleteColumns(unsigned int column, int count = 1);
+  void attachJournal(std::ostream *journal) { m_journal.os = journal; }
+  bool replayJournal(std::istream &is);
+  bool compact(std::ostream &base, std::ostream *journal);
+  std::map<CPos, CCell> page; 
+
+private:
+  friend class Reference; // Reads referenced cells with read, so their texts are not copied
+  struct CEvalContext // State shared by all cells evaluated within one read
+  {
+    std::map<CPos, int> state;     // dfsCycleCheck marks
+    std::map<CPos, CEvalValue> values; // Cells already evaluated
+  };
+  class CEvalScope;
+  struct CJournalLink // Edits are appended here before they are applied, copies of the sheet start detached
+  {
+    CJournalLink() = default;
+    CJournalLink(const CJournalLink &) {}
+    CJournalLink &operator=(const CJournalLink &) { return *this; }
+    std::ostream *os = nullptr;
+  };
+  static constexpr char JOURNAL_SET = 'S', JOURNAL_BATCH = 'B', JOURNAL_COPY = 'C', JOURNAL_FILL = 'F', JOURNAL_SHIFT = 'L';
+  bool journal(char kind, const std::string &payload);
+  bool journalSet(const CPos &pos, std::string_view contents);
+  bool journalBatch(std::span<const std::pair<CPos, std::string>> cells);
+  CEvalValue evaluate(const CPos &pos);
+  CEvalValue read(const CPos &pos);
+  CCell *findCell(const CPos &pos);
+  void materializeAll();
+  void visitRange(unsigned int top, unsigned int left, uint64_t bottom, uint64_t right, const std::function<void(const CPos &, const CCell &)> &visitor, bool columnMajor) const;
+  bool storeCells(std::vector<std::pair<CPos, CCell>> &&cells);
+  bool fill(CPos src, int w, int h, int count, bool down, double step);
+  void replicate(const CPos &src, int w, int h, int64_t rowStep, int64_t columnStep, int count, double step);
+  bool shiftLines(const CShift &shift);
+  void invalidate(const CPos &pos);
+  bool touchTile(unsigned int row, bool write);
+  bool touchTiles(const std::vector<std::pair<CPos, CCell>> &cells);
+  bool spillReadable(uint64_t top, uint64_t bottom) const;
+  void trimTiles();
+  std::map<CPos, CCell>::iterator tileEnd(uint32_t tile);
+  bool writeSnapshot(std::ostream &os, const std::function<CEvalValue(const CPos &)> *valueOf) const;
+  CEvalContext *m_eval = nullptr;
+  std::shared_ptr<const CMappedFile> m_file; // Snapshot served in place, cells in page take precedence over it
+  CSnapshotView m_mapped;
+  bool m_lazyParsing = false; // Loaded formulas are parsed on first evaluation
+  bool m_compressSnapshots = false; // saveBinary encodes cells with compress_cells, mapped loads then decode them to memory
+  std::map<CPos, CEvalValue> m_persisted;             // Formula values loaded from snapshot, dropped once an input changes
+  std::map<CPos, std::vector<CPos>> m_dependents;    // Reverse edges of persisted formulas, built on first edit
+  CJournalLink m_journal;
+  CParseCache m_parseCache; // Used by setCell, setCells, load and importCSV
+  std::optional<CTilePager> m_pager; // Set by enablePaging
+};
+
+class CSpreadsheet::CEvalScope // Opens evaluation context for top level read, nested reads reuse it
+{
+public:
+  explicit CEvalScope(CSpreadsheet &sheet) : m_sheet(sheet), m_owner(sheet.m_eval == nullptr)
+  {
+    if (m_owner)
+      m_sheet.m_eval = &m_ctx;
+  }
+  ~CEvalScope()
+  {
+    if (!m_owner)
+      return;
+    m_sheet.m_eval = nullptr;
+    m_sheet.trimTiles(); // Nothing points into page any more
+  }
+
+private:
+  CSpreadsheet &m_sheet;
+  bool m_owner;
+  CEvalContext m_ctx;
+};
+
+bool CSpreadsheet::dfsCycleCheck(const CPos &pos, std::map<CPos, int> &state)
+{
+  if (state[pos] == 1)
+    return true; // Cycle found, this cell is already being visited
+  if (state[pos] == 2)
+    return false; // Already fully processed this cell
+
+  state[pos] = 1;
+  const CCell *cell = findCell(pos);
+  if (cell != nullptr && cell->get_type() == CCell::type::FORMULA)
+  {
+    for (uint64_t ref : cell->getReferences())
+    {
+      CPos refPos(unsigned(ref >> 32), unsigned(ref));
+      if (findCell(refPos) != nullptr && dfsCycleCheck(refPos, state))
+      {
+        return true;
+      }
+    }
+  }
+  state[pos] = 2;
+  return false;
+}
+
+CValue CSpreadsheet::getValue(CPos pos)
+{
+  CEvalScope scope(*this);
+  return to_value(evaluate(pos));
+};
+
+CEvalValue CSpreadsheet::read(const CPos &pos) // getValue for formulas, the value keeps sharing its text
+{
+  CEvalScope scope(*this);
+  return evaluate(pos);
+}
+
+CEvalValue CSpreadsheet::evaluate(const CPos &pos) // Evaluates cell at most once per read, cycle marks are reused across cells
+{
+  auto memo = m_eval->values.find(pos);
+  if (memo != m_eval->values.end())
+    return memo->second;
+  if (auto persisted = m_persisted.find(pos); persisted != m_persisted.end())
+    return persisted->second;
+
+  CEvalValue result;
+  std::optional<uint64_t> mapped;
+  if (!touchTile(pos.row, false))
+    throw std::runtime_error("Damaged spill record");
+  if (m_file && page.find(pos) == page.end() && (mapped = m_mapped.find(pos.row, pos.column)) && m_mapped.type(*mapped) != CCell::FORMULA)
+  { // Literals are answered straight from the mapped pages
+    if (m_mapped.type(*mapped) == CCell::NUMERIC)
+      result = m_mapped.number(*mapped);
+    else
+      result = CText(std::string(m_mapped.text(*mapped)));
+  }
+  else if (CCell *cell = findCell(pos); cell != nullptr)
+  {
+    if (cell->get_type() != CCell::FORMULA)
+      return cell->getValue(this); // Literals need neither cycle check nor memo
+    if (!dfsCycleCheck(pos, m_eval->state))
+      result = cell->getValue(this);
+  }
+  m_eval->values.emplace(pos, result);
+  return result;
+}
+
+CCell *CSpreadsheet::findCell(const CPos &pos) // Cell stored at pos, cells of mapped snapshot are deserialized on first touch
+{
+  if (!touchTile(pos.row, false))
+    throw std::runtime_error("Damaged spill record");
+  auto it = page.find(pos);
+  if (it != page.end())
+    return &it->second;
+  if (!m_file)
+    return nullptr;
+  auto index = m_mapped.find(pos.row, pos.column);
+  if (!index)
+    return nullptr;
+  try
+  {
+    return &page.emplace(pos, m_mapped.cell(*index)).first->second;
+  }
+  catch (const std::invalid_argument &)
+  {
+    return nullptr; // Damaged record reads as empty cell
+  }
+}
+
+void CSpreadsheet::invalidate(const CPos &pos) // Drops persisted values of pos and of every formula that depends on it
+{
+  if (m_persisted.empty())
+    return;
+  if (m_dependents.empty())
+  {
+    for (const auto &[formula, value] : m_persisted)
+      if (const CCell *cell = findCell(formula))
+        for (const auto &ref : cell->getReferences())
+          m_dependents[CPos(unsigned(ref >> 32), unsigned(ref))].push_back(formula);
+  }
+
+  std::vector<CPos> dirty = {pos};
+  m_persisted.erase(pos);
+  while (!dirty.empty())
+  {
+    auto it = m_dependents.find(dirty.back());
+    dirty.pop_back();
+    if (it == m_dependents.end())
+      continue;
+    for (const auto &dependent : it->second)
+      if (m_persisted.erase(dependent))
+        dirty.push_back(dependent);
+  }
+  if (m_persisted.empty())
+    m_dependents.clear();
+}
+
+void CSpreadsheet::materializeAll() // Moves every cell of the mapped snapshot into page and drops the mapping
+{
+  if (!m_file)
+    return;
+  auto hint = page.begin();
+  for (uint64_t i = 0; i < m_mapped.cellCount(); ++i)
+  {
+    CPos pos(m_mapped.row(i), m_mapped.column(i));
+    touchTile(pos.row, true); // Cells no longer have other copy
+    hint = page.lower_bound(pos);
+    if (hint != page.end() && !(pos < hint->first))
+      continue; // Overwritten after mapping
+    try
+    {
+      page.emplace_hint(hint, pos, m_mapped.cell(i));
+    }
+    catch (const std::invalid_argument &)
+    {
+    }
+  }
+  m_file.reset();
+  m_mapped = CSnapshotView();
+}
+
+std::vector<CValue> CSpreadsheet::getValues(CPos topLeft, int w, int h) // Row-major values of w x h rectangle, empty cells are std::monostate
+{
+  if (w <= 0 || h <= 0)
+    return {};
+  std::vector<CValue> values(size_t(w) * size_t(h));
+  CEvalScope scope(*this);
+  auto [top, left] = topLeft.getRaC();
+
+  visitCells(topLeft, w, h, [&](const CPos &pos, const CCell &)
+             { values[size_t(pos.row - top) * w + (pos.column - left)] = to_value(evaluate(pos)); });
+  return values;
+}
+
+void CSpreadsheet::visitCells(CPos topLeft, int w, int h, const std::function<void(const CPos &, const CCell &)> &visitor, bool columnMajor) const
+{ // Calls visitor for every occupied cell of the rectangle, empty stretches are skipped by seeking in the page
+  if (w <= 0 || h <= 0)
+    return;
+  auto [top, left] = topLeft.getRaC();
+  visitRange(top, left, uint64_t(top) + h, uint64_t(left) + w, visitor, columnMajor);
+}
+
+void CSpreadsheet::visitAllCells(const std::function<void(const CPos &, const CCell &)> &visitor) const // Every occupied cell of the sheet in row-major order, last row and column included
+{
+  visitRange(0, 0, uint64_t(UINT_MAX) + 1, uint64_t(UINT_MAX) + 1, visitor, false);
+}
+
+void CSpreadsheet::visitRange(unsigned int top, unsigned int left, uint64_t bottom, uint64_t right, const std::function<void(const CPos &, const CCell &)> &visitor, bool columnMajor) const
+{ // Rows top to bottom - 1 and columns left to right - 1, bounds are 64-bit so the extent can reach past the last position
+  std::vector<std::pair<CPos, const CCell *>> found;
+  std::list<CCell> restored; // Mapped cells handed to visitor, page is not touched by visiting
+
+  auto emit = [&](const CPos &pos, const CCell &cell)
+  {
+    if (columnMajor)
+      found.emplace_back(pos, &cell);
+    else
+      visitor(pos, cell);
+  };
+
+  auto it = page.lower_bound(CPos(top, left));
+  auto nextStored = [&]()
+  {
+    while (it != page.end() && it->first.row < bottom)
+    {
+      const CPos &pos = it->first;
+      if (pos.column < left)
+        it = page.lower_bound(CPos(pos.row, left));
+      else if (pos.column >= right && pos.row == UINT_MAX)
+        it = page.end();
+      else if (pos.column >= right)
+        it = page.lower_bound(CPos(pos.row + 1, left));
+      else
+        return true;
+    }
+    return false;
+  };
+
+  uint64_t index = m_file ? m_mapped.lowerBound(top, left) : 0, count = m_file ? m_mapped.cellCount() : 0;
+  auto nextMapped = [&]()
+  {
+    while (index < count && m_mapped.row(index) < bottom)
+    {
+      unsigned int row = m_mapped.row(index), column = m_mapped.column(index);
+      if (column < left)
+        index = m_mapped.lowerBound(row, left);
+      else if (column >= right && row == UINT_MAX)
+        index = count;
+      else if (column >= right)
+        index = m_mapped.lowerBound(row + 1, left);
+      else
+        return true;
+    }
+    return false;
+  };
+
+  std::vector<std::pair<CPos, CCell>> spilled; // Cells of tiles that are only in the spill file, read without making them resident
+  if (m_pager)
+    for (const auto &entry : m_pager->spilled)
+      if (!m_pager->resident.count(entry.first) && uint64_t(entry.first + 1) * CTilePager::TILE_ROWS > top && uint64_t(entry.first) * CTilePager::TILE_ROWS < bottom)
+      {
+        std::vector<std::pair<CPos, CCell>> cells;
+        if (!m_pager->read(entry.first, cells))
+          throw std::runtime_error("Damaged spill record");
+        for (auto &cell : cells)
+          if (cell.first.row >= top && cell.first.row < bottom && cell.first.column >= left && cell.first.column < right)
+            spilled.push_back(std::move(cell));
+      }
+  std::sort(spilled.begin(), spilled.end(), [](const auto &a, const auto &b)
+            { return a.first < b.first; });
+  size_t next = 0;
+
+  bool hasStored = nextStored(), hasMapped = nextMapped();
+  while (hasStored || hasMapped || next < spilled.size())
+  {
+    bool hasSpilled = next < spilled.size(), fromSpill = hasSpilled && (!hasStored || spilled[next].first < it->first);
+    if (hasMapped && ((!hasStored && !hasSpilled) || std::make_pair(m_mapped.row(index), m_mapped.column(index)) < (fromSpill ? spilled[next].first : it->first).getRaC()))
+    {
+      try
+      {
+        restored.push_back(m_mapped.cell(index));
+        emit(CPos(m_mapped.row(index), m_mapped.column(index)), restored.back());
+      }
+      catch (const std::invalid_argument &)
+      {
+      }
+      if (!columnMajor)
+        restored.clear();
+      ++index;
+      hasMapped = nextMapped();
+      continue;
+    }
+    const CPos &pos = fromSpill ? spilled[next].first : it->first;
+    if (hasMapped && std::make_pair(m_mapped.row(index), m_mapped.column(index)) == pos.getRaC())
+    { // Cell was rewritten after mapping, the stored one wins
+      ++index;
+      hasMapped = nextMapped();
+    }
+    if (fromSpill)
+    {
+      emit(pos, spilled[next].second);
+      ++next;
+      continue;
+    }
+    if (hasSpilled && !(it->first < spilled[next].first))
+      ++next; // Tile was paged in while visiting, page holds the same cell
+    emit(it->first, it->second);
+    ++it;
+    hasStored = nextStored();
+  }
+
+  if (!columnMajor)
+    return;
+  std::stable_sort(found.begin(), found.end(), [](const auto &a, const auto &b)
+                   { return a.first.column < b.first.column; });
+  for (const auto &[pos, cell] : found)
+    visitor(pos, *cell);
+}
+
+bool CSpreadsheet::setCell(CPos pos, std::string contents)
+{
+  CCell tmp;
+  if (m_parseCache.parse(contents, pos, tmp) != std::errc())
+    return false; // Return false if the cell contents are invalid
+  if (!touchTile(pos.row, true))
+    return false; // Spill copy of the tile is damaged, the sheet stays as it was
+  if (!journalSet(pos, contents))
+  {
+    trimTiles();
+    return false;
+  }
+  invalidate(pos);
+  page[pos] = tmp;
+  trimTiles();
+  return true; 
+}
+
+bool CSpreadsheet::setCells(std::span<const std::pair<CPos, std::string>> cells) // Applies all edits at once, or none of them if any cell fails to parse
+{
+  std::vector<std::pair<CPos, CCell>> parsed;
+  parsed.reserve(cells.size());
+  for (const auto &[pos, contents] : cells)
+  {
+    parsed.emplace_back(pos, CCell());
+    if (m_parseCache.parse(contents, pos, parsed.back().second) != std::errc())
+      return false; // Nothing was written yet, so the sheet stays as it was
+  }
+  if (!touchTiles(parsed))
+    return false;
+  if (!journalBatch(cells))
+  {
+    trimTiles();
+    return false; // One record, so replay never sees part of the batch
+  }
+  return storeCells(std::move(parsed));
+}
+
+bool CSpreadsheet::storeCells(std::vector<std::pair<CPos, CCell>> &&cells) // Writes already parsed cells in one sorted pass, later entries for the same position win
+{ // False without writing anything when a tile cannot be read back from the spill file
+  if (!touchTiles(cells))
+    return false;
+  std::vector<size_t> order(cells.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  auto byPosition = [&](size_t a, size_t b)
+  { return cells[a].first < cells[b].first; };
+  if (!std::is_sorted(order.begin(), order.end(), byPosition))
+    std::stable_sort(order.begin(), order.end(), byPosition);
+
+  auto hint = page.begin();
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    if (i + 1 < order.size() && !byPosition(order[i], order[i + 1]))
+      continue; // Same position is written again later in the batch
+    auto &[pos, cell] = cells[order[i]];
+    invalidate(pos);
+    touchTile(pos.row, true); // Resident since touchTiles
+    hint = std::next(page.insert_or_assign(hint, std::move(pos), std::move(cell)));
+  }
+  trimTiles();
+  return true;
+}
+
+/* Text save file is sequence of records terminated by char(31):
+ *   BUNK<position>CONT<contents>   one cell
+ *   CRC<8 hex digits>              CRC32C of all bytes since the previous CRC record, written after every TEXT_BLOCK bytes
+ *                                  and at the end; files without CRC records are loaded unchecked
+ */
+constexpr size_t TEXT_BLOCK = 1 << 16;
+
+void close_block(std::string &block)
+{
+  char tag[16];
+  snprintf(tag, sizeof(tag), "CRC%08X", unsigned(crc32c(block)));
+  block += tag;
+  block += char(31);
+}
+
+bool CSpreadsheet::save(std::ostream &os) const
+{
+  bool ok = true;
+  std::string block;
+  auto flush = [&]
+  {
+    close_block(block);
+    os.write(block.data(), block.size());
+    block.clear();
+    if (!os)
+    {
+      std::cerr << "Error writing to output stream." << std::endl;
+      ok = false;
+    }
+  };
+  visitAllCells([&](const CPos &pos, const CCell &cell)
+             {
+    if (!ok || cell.get_type() == CCell::EMPTY)
+      return; // Cleared cell, saveBinary skips it too
+    std::string encodedContent = cell.getContent();
+
+    block += "BUNK";
+    block += pos.getCode();
+    block += "CONT";
+    block += encodedContent;
+    block += char(31);
+    if (block.size() >= TEXT_BLOCK)
+      flush(); });
+  if (ok && !block.empty())
+    flush();
+  return ok;
+}
+
+bool is_crc_record(std::string_view record)
+{
+  return record.size() == 11 && record.substr(0, 3) == "CRC";
+}
+
+bool verify_blocks(std::string_view data, bool &checksummed) // Checks every CRC record before anything is parsed
+{
+  checksummed = false;
+  size_t blockBegin = 0, tag = 0;
+  while ((tag = data.find("\x1f" "CRC", tag)) != std::string_view::npos)
+  {
+    tag += 1;
+    if (data.size() - tag < 12 || data[tag + 11] != char(31))
+      return false;
+    uint32_t stored = 0;
+    auto [end, ec] = std::from_chars(data.data() + tag + 3, data.data() + tag + 11, stored, 16);
+    if (ec != std::errc() || end != data.data() + tag + 11 || stored != crc32c(data.substr(blockBegin, tag - blockBegin)))
+      return false;
+    checksummed = true;
+    blockBegin = tag += 12;
+  }
+  return !checksummed || blockBegin == data.size(); // Bytes after the last checksum would be unverified
+}
+
+std::string read_stream(std::istream &is) // Whole remaining stream in one buffer, read in large blocks
+{
+  constexpr size_t BLOCK = 1 << 16;
+  std::string data;
+  size_t used = 0;
+  do
+  {
+    data.resize(used + BLOCK);
+    is.read(data.data() + used, BLOCK);
+    used += is.gcount();
+  } while (is);
+  data.resize(used);
+  return data;
+}
+
+bool parse_records(std::string_view data, std::vector<std::pair<CPos, CCell>> &cells, bool deferParsing, bool checksummed, CParseCache *cache = nullptr) // Parses BUNK/CONT records, false on the first broken one
+{
+  const char *cur = data.data(), *end = data.data() + data.size();
+  while (cur < end)
+  {
+    const char *separator = static_cast<const char *>(memchr(cur, char(31), end - cur)); // Vectorized by the C library
+    if (separator == nullptr)
+      separator = end;
+    std::string_view record(cur, separator - cur);
+    cur = separator + 1;
+    if (record.empty() || (checksummed && is_crc_record(record)))
+      continue;
+
+    size_t bunkPos = record.find("BUNK");
+    size_t contPos = bunkPos == std::string_view::npos ? bunkPos : record.find("CONT", bunkPos + 4);
+    if (contPos == std::string_view::npos)
+      return false;
+
+    std::optional<CPos> pos = CPos::fromCode(record.substr(bunkPos + 4, contPos - (bunkPos + 4)));
+    if (!pos)
+      return false; // Invalid position
+    cells.emplace_back(std::move(*pos), CCell());
+    std::string_view contents = record.substr(contPos + 4);
+    if ((cache ? cache->parse(contents, cells.back().first, cells.back().second, deferParsing) : CCell::parse(contents, cells.back().second, deferParsing)) != std::errc())
+      return false; // Invalid contents
+  }
+  return true;
+}
+
+bool CSpreadsheet::load(std::istream &is)
+{
+  std::string data = read_stream(is);
+  std::vector<std::pair<CPos, CCell>> cells;
+  bool checksummed;
+  if (!verify_blocks(data, checksummed) || !parse_records(data, cells, m_lazyParsing, checksummed, &m_parseCache))
+    return false; // Nothing was written yet
+  return storeCells(std::move(cells)); // Whole file is applied as one batch, a broken record leaves the sheet untouched
+}
+
+bool CSpreadsheet::loadParallel(std::istream &is, unsigned threads) // Same as load, records are parsed on several threads
+{
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string data = read_stream(is);
+  bool checksummed;
+  if (!verify_blocks(data, checksummed))
+    return false;
+
+  std::vector<std::string_view> chunks;
+  size_t begin = 0;
+  for (unsigned i = 1; i <= threads && begin < data.size(); ++i)
+  { // Chunks end right after a separator, so no record is split
+    size_t end = i == threads ? data.size() : std::max(begin, data.size() / threads * i);
+    end = std::min(data.find(char(31), end), data.size());
+    end += end < data.size();
+    chunks.push_back(std::string_view(data).substr(begin, end - begin));
+    begin = end;
+  }
+
+  std::vector<std::vector<std::pair<CPos, CCell>>> parsed(chunks.size());
+  std::unique_ptr<bool[]> ok(new bool[chunks.size()]());
+  {
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunks.size(); ++i)
+      workers.emplace_back([&, i]
+                           { ok[i] = parse_records(chunks[i], parsed[i], m_lazyParsing, checksummed); });
+    if (!chunks.empty())
+      ok[0] = parse_records(chunks[0], parsed[0], m_lazyParsing, checksummed);
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < chunks.size(); ++i)
+  {
+    if (!ok[i])
+      return false; // Nothing was written yet
+    total += parsed[i].size();
+  }
+  std::vector<std::pair<CPos, CCell>> cells;
+  cells.reserve(total);
+  for (auto &part : parsed)
+    std::move(part.begin(), part.end(), std::back_inserter(cells));
+  return storeCells(std::move(cells));
+}
+
+const char *find_csv_special(const char *cur, const char *end) // First ',', '"', '\r' or '\n', 16 bytes are checked at once with SSE2
+{
+#ifdef __SSE2__
+  const __m128i comma = _mm_set1_epi8(','), quote = _mm_set1_epi8('"'), cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+  for (; end - cur >= 16; cur += 16)
+  {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cur));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, quote)),
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+    if (unsigned int mask = _mm_movemask_epi8(hits))
+      return cur + std::countr_zero(mask);
+  }
+#endif
+  for (; cur < end; ++cur)
+    if (*cur == ',' || *cur == '"' || *cur == '\r' || *cur == '\n')
+      return cur;
+  return end;
+}
+
+bool CSpreadsheet::importCSV(std::istream &is, CPos origin) // RFC 4180 fields become cells from origin on, empty fields leave cells as they are
+{
+  std::string data = read_stream(is);
+  auto [top, left] = origin.getRaC();
+  uint64_t row = top, column = left;
+  std::vector<std::pair<CPos, CCell>> cells;
+  std::string unquoted;
+  const char *cur = data.data(), *end = data.data() + data.size();
+  while (cur < end)
+  {
+    std::string_view field;
+    if (*cur == '"')
+    {
+      unquoted.clear();
+      for (++cur;;)
+      {
+        const char *quote = static_cast<const char *>(memchr(cur, '"', end - cur));
+        if (quote == nullptr)
+          return false; // Unterminated quoted field
+        unquoted.append(cur, quote);
+        cur = quote + 1;
+        if (cur == end || *cur != '"')
+          break;
+        unquoted.push_back('"'); // Doubled quote
+        ++cur;
+      }
+      if (cur < end && *cur != ',' && *cur != '\r' && *cur != '\n')
+        return false; // Text after closing quote
+      field = unquoted;
+    }
+    else
+    {
+      const char *stop = find_csv_special(cur, end);
+      if (stop < end && *stop == '"')
+        return false; // Quote inside unquoted field
+      field = std::string_view(cur, stop - cur);
+      cur = stop;
+    }
+
+    if (!field.empty())
+    {
+      if (row > INT_MAX || column > INT_MAX)
+        return false; // Past the last row or column of the sheet
+      cells.emplace_back(CPos(unsigned(row), unsigned(column)), CCell());
+      if (m_parseCache.parse(field, cells.back().first, cells.back().second, m_lazyParsing) != std::errc())
+        return false; // Nothing was written yet
+    }
+
+    if (cur == end)
+      break;
+    if (*cur == ',')
+      ++column;
+    else
+    {
+      cur += *cur == '\r' && cur + 1 < end && cur[1] == '\n';
+      ++row;
+      column = left;
+    }
+    ++cur;
+  }
+  return storeCells(std::move(cells));
+}
+
+bool CSpreadsheet::exportCSV(std::ostream &os, CPos topLeft, int w, int h) // Values of w x h rectangle, each row is one line of w fields
+{
+  if (w <= 0 || h <= 0)
+    return true;
+  CEvalScope scope(*this);
+  auto [top, left] = topLeft.getRaC();
+  unsigned int row = top, commas = 0; // Commas already written on the current row
+  std::string out;
+  bool ok = true;
+
+  auto flush = [&]()
+  {
+    os.write(out.data(), out.size());
+    out.clear();
+    ok = ok && bool(os);
+  };
+  auto endRow = [&]()
+  {
+    out.append(w - 1 - commas, ',');
+    out += '\n';
+    commas = 0;
+    ++row;
+    if (out.size() >= (1 << 16))
+      flush();
+  };
+
+  visitCells(topLeft, w, h, [&](const CPos &pos, const CCell &)
+             {
+    while (row < pos.row)
+      endRow();
+    out.append(pos.column - left - commas, ',');
+    commas = pos.column - left;
+    CEvalValue value = evaluate(pos);
+    if (std::holds_alternative<double>(value))
+      out += CNumberText(std::get<double>(value)).view();
+    else if (std::holds_alternative<CText>(value))
+    {
+      const std::string &text = std::get<CText>(value).str();
+      if (text.find_first_of(",\"\r\n") == std::string::npos)
+        out += text;
+      else
+      {
+        out += '"';
+        for (char c : text)
+          out.append(c == '"' ? 2 : 1, c);
+        out += '"';
+      }
+    } });
+  while (row - top < unsigned(h))
+    endRow();
+  flush();
+  return ok;
+}
+
+void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h)
+{
+  std::string payload;
+  for (unsigned int value : {dst.row, dst.column, src.row, src.column, unsigned(w), unsigned(h)})
+    put_le<uint32_t>(payload, value);
+  if (w <= 0 || h <= 0 || !spillReadable(src.row, uint64_t(src.row) + h) || !spillReadable(dst.row, uint64_t(dst.row) + h) || !journal(JOURNAL_COPY, payload))
+    return;
+  replicate(src, w, h, int64_t(dst.row) - src.row, int64_t(dst.column) - src.column, 1, 0);
+}
+
+bool CSpreadsheet::fillDown(CPos src, int w, int h, int count) // Repeats the block count times right below itself
+{
+  return fill(src, w, h, count, true, 0);
+}
+
+bool CSpreadsheet::fillRight(CPos src, int w, int h, int count) // Repeats the block count times to the right of itself
+{
+  return fill(src, w, h, count, false, 0);
+}
+
+bool CSpreadsheet::fillSeries(CPos src, int w, int h, int count, double step, bool down) // Like fillDown or fillRight, numbers grow by step with every repetition
+{
+  return fill(src, w, h, count, down, step);
+}
+
+bool CSpreadsheet::fill(CPos src, int w, int h, int count, bool down, double step)
+{
+  if (w <= 0 || h <= 0 || count <= 0)
+    return false;
+  int64_t end = down ? src.row + int64_t(h) * (count + 1) : src.column + int64_t(w) * (count + 1);
+  if (end - 1 > INT_MAX)
+    return false; // Past the last row or column of the sheet
+  std::string payload;
+  for (unsigned int value : {src.row, src.column, unsigned(w), unsigned(h), unsigned(count)})
+    put_le<uint32_t>(payload, value);
+  payload.push_back(down ? 'D' : 'R');
+  put_double(payload, step);
+  if (!spillReadable(src.row, down ? end : uint64_t(src.row) + h) || !journal(JOURNAL_FILL, payload))
+    return false;
+  replicate(src, w, h, down ? h : 0, down ? 0 : w, count, step);
+  return true;
+}
+
+void CSpreadsheet::replicate(const CPos &src, int w, int h, int64_t rowStep, int64_t columnStep, int count, double step)
+{ // Writes count copies of the block, k-th one moved by k steps. Either count is 1, or copies are stacked down or right
+  // without gaps. The source is read before anything is written, so an overlapping copy works as if through a temporary.
+  if (w <= 0 || h <= 0 || count <= 0)
+    return;
+  std::vector<std::pair<CPos, CCell>> block;
+  visitCells(src, w, h, [&](const CPos &pos, const CCell &cell)
+             { block.emplace_back(pos, cell); });
+
+  auto inside = [](int64_t row, int64_t column)
+  { return row >= 0 && row <= INT_MAX && column >= 1 && column <= INT_MAX; };
+  int64_t top = src.row + rowStep, left = src.column + columnStep; // Area covered by all copies
+  int64_t bottom = src.row + h + rowStep * count, right = src.column + w + columnStep * count;
+  std::vector<CPos> occupied; // Targets that are cleared unless a copy lands on them
+  if (inside(top, left))
+    visitRange(unsigned(top), unsigned(left), uint64_t(bottom), uint64_t(right), [&](const CPos &pos, const CCell &)
+               { occupied.push_back(pos); }, false);
+
+  // Targets are produced in row-major order, so page is written in one forward pass with hints, tile after tile
+  auto hint = page.begin();
+  size_t nextOccupied = 0;
+  uint32_t tile = UINT32_MAX;
+  auto write = [&](const CPos &pos, CCell &&cell)
+  {
+    if (m_pager && pos.row / CTilePager::TILE_ROWS != tile)
+    { // Finished tiles may be spilled before the next one fills
+      trimTiles();
+      tile = pos.row / CTilePager::TILE_ROWS;
+      hint = page.lower_bound(pos);
+    }
+    invalidate(pos);
+    if (!touchTile(pos.row, true))
+      throw std::runtime_error("Damaged spill record"); // Checked by spillReadable, so only a failing spill file gets here
+    hint = std::next(page.insert_or_assign(hint, pos, std::move(cell)));
+  };
+  auto store = [&](int64_t row, int64_t column, CCell &&cell)
+  {
+    if (!inside(row, column))
+      return;
+    CPos pos{unsigned(row), unsigned(column)};
+    for (; nextOccupied < occupied.size() && occupied[nextOccupied] < pos; ++nextOccupied)
+      write(occupied[nextOccupied], CCell());
+    if (nextOccupied < occupied.size() && !(pos < occupied[nextOccupied]))
+      ++nextOccupied;
+    write(pos, std::move(cell));
+  };
+  auto copyOf = [&](const CCell &cell, int k)
+  {
+    if (step != 0 && cell.get_type() == CCell::NUMERIC)
+    {
+      double number = std::get<double>(cell.getValue(this)) + step * k;
+      return CCell::restore(CCell::NUMERIC, number_to_text(number), number, {});
+    }
+    std::optional<CCell> moved = cell.moved(int(rowStep * k), int(columnStep * k));
+    return moved ? std::move(*moved) : CCell(); // Formula pointing outside the sheet clears its target
+  };
+
+  if (rowStep == 0 && count > 1)
+  { // Copies side by side, each row of the block is repeated before the next row
+    for (size_t first = 0, last; first < block.size(); first = last)
+    {
+      for (last = first; last < block.size() && block[last].first.row == block[first].first.row; ++last)
+        ;
+      for (int k = 1; k <= count; ++k)
+        for (size_t i = first; i < last; ++i)
+          store(block[i].first.row, block[i].first.column + columnStep * k, copyOf(block[i].second, k));
+    }
+  }
+  else
+    for (int k = 1; k <= count; ++k)
+      for (const auto &[pos, cell] : block)
+        store(pos.row + rowStep * k, pos.column + columnStep * k, copyOf(cell, k));
+  for (; nextOccupied < occupied.size(); ++nextOccupied)
+    write(occupied[nextOccupied], CCell());
+  trimTiles();
+}
+
+bool CSpreadsheet::insertRows(unsigned int row, int count) // Rows from row on move count rows down, references to them follow
+{
+  return count > 0 && shiftLines({true, row, count});
+}
+
+bool CSpreadsheet::deleteRows(unsigned int row, int count) // Rows row to row + count - 1 disappear, references to them become #REF!
+{
+  return count > 0 && shiftLines({true, row, -count});
+}
+
+bool CSpreadsheet::insertColumns(unsigned int column, int count)
+{
+  return count > 0 && shiftLines({false, column, count});
+}
+
+bool CSpreadsheet::deleteColumns(unsigned int column, int count)
+{
+  return count > 0 && shiftLines({false, column, -count});
+}
+
+bool CSpreadsheet::shiftLines(const CShift &shift) // Moves cells past shift.at and rewrites every reference that points there, false when cells would leave the sheet
+{ // Moved cells are extracted and inserted again under their new keys, nodes and cells are not copied
+  if (shift.count == 0 || shift.at > INT_MAX || (!shift.rows && shift.at < 1))
+    return false;
+  if (m_pager)
+    for (auto spilled = m_pager->spilled; const auto &entry : spilled)
+      if (!touchTile(entry.first * CTilePager::TILE_ROWS, true)) // Tiles are bands of rows, every cell is brought in to move
+      {
+        trimTiles();
+        return false;
+      }
+  materializeAll();
+  auto first = shift.rows ? page.lower_bound(CPos(shift.at, 0)) : page.begin();
+  if (shift.count > 0)
+    for (auto it = first; it != page.end(); ++it)
+    {
+      int64_t row = it->first.row, column = it->first.column;
+      if (it->second.get_type() != CCell::EMPTY && !shift.apply(row, column))
+      {
+        trimTiles();
+        return false; // Would be pushed off the sheet
+      }
+    }
+
+  std::string payload(1, shift.rows ? 'R' : 'C');
+  put_le<uint32_t>(payload, shift.at);
+  put_le<uint32_t>(payload, uint32_t(shift.count));
+  if (!journal(JOURNAL_SHIFT, payload))
+  {
+    trimTiles();
+    return false;
+  }
+
+  std::vector<std::map<CPos, CCell>::node_type> moved;
+  for (auto it = first; it != page.end();)
+  {
+    int64_t row = it->first.row, column = it->first.column;
+    if (!shift.moves(row, column))
+    {
+      ++it;
+      continue;
+    }
+    auto node = page.extract(it++);
+    if (shift.apply(row, column)) // Otherwise deleted, or cleared marker pushed off the sheet
+    {
+      node.key() = CPos(unsigned(row), unsigned(column));
+      moved.push_back(std::move(node));
+    }
+  }
+  auto hint = page.end();
+  for (auto &node : moved) // Still in order, row shifts append every one of them
+    hint = std::next(page.insert(hint, std::move(node)));
+  for (auto &[pos, cell] : page)
+    cell.shiftReferences(shift);
+  m_persisted.clear(); // Keyed by old positions
+  m_dependents.clear();
+
+  if (m_pager)
+  { // Spill copies hold cells at old rows, every tile starts over as resident and dirty
+    m_pager->resident.clear();
+    m_pager->lru.clear();
+    m_pager->spilled.clear();
+    for (auto it = page.begin(); it != page.end(); it = tileEnd(it->first.row / CTilePager::TILE_ROWS))
+      touchTile(it->first.row, true);
+  }
+  trimTiles();
+  return true;
+}
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+class Reference final : public Expr
+{
+public:
+  CPos pos;
+
+  Reference(CPos m_pos)
+      : pos(m_pos) {}
+  int getType() const override { return 1; }
+  void serialize(std::string &out) const override
+  {
+    out.push_back(char(ExprOp::REFERENCE));
+    put_le<uint32_t>(out, pos.row);
+    put_le<uint32_t>(out, pos.column);
+    out.push_back(char((pos.relative_column ? 0 : 1) | (pos.relative_row ? 0 : 2)));
+  }
+  CEvalValue eval(CSpreadsheet *spreadsheet) const override
+  {
+    return spreadsheet->read(pos); // Empty cell evaluates to std::monostate
+  }
+};
+
+void expBuilder::valReference(std::string val)
+{
+  valReference(std::string_view(val));
+}
+
+void expBuilder::valReference(std::string_view val)
+{
+  CPos pos(val);
+  valReference(pos);
+}
+
+void expBuilder::valReference(const CPos &pos)
+{
+  references.push_back(pack_position(pos.row, pos.column));
+  exprStack.push(std::make_shared<Reference>(pos));
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void replay_program(std::string_view program, expBuilder &builder, int rowShift, int columnShift) // Rebuilds expression tree from postfix program, no parsing involved
+{ // Relative parts of references move by the shifts, absolute parts stay
+  size_t i = 0, depth = 0;
+  auto need = [&](size_t bytes, size_t operands)
+  {
+    if (program.size() - i < bytes || depth < operands)
+      throw std::invalid_argument("Malformed formula program");
+  };
+
+  while (i < program.size())
+  {
+    ExprOp op = ExprOp(program[i++]);
+    switch (op)
+    {
+    case ExprOp::NUMBER:
+      need(8, 0);
+      builder.valNumber(get_double(program.data() + i));
+      i += 8;
+      ++depth;
+      break;
+    case ExprOp::TEXT:
+    {
+      need(4, 0);
+      uint32_t length = get_le<uint32_t>(program.data() + i);
+      i += 4;
+      need(length, 0);
+      builder.valString(std::string(program.substr(i, length)));
+      i += length;
+      ++depth;
+      break;
+    }
+    case ExprOp::REFERENCE:
+    {
+      need(9, 0);
+      int64_t row = get_le<uint32_t>(program.data() + i), column = get_le<uint32_t>(program.data() + i + 4);
+      uint8_t flags = program[i + 8];
+      i += 9;
+      row += flags & 2 ? 0 : rowShift;
+      column += flags & 1 ? 0 : columnShift;
+      if (row < 0 || row > INT_MAX || column < 1 || column > INT_MAX)
+        throw std::invalid_argument("Reference moved outside of the sheet");
+      CPos pos(unsigned(row), unsigned(column), !(flags & 1), !(flags & 2), back_to_code(unsigned(row), unsigned(column), flags & 1, flags & 2));
+      builder.valReference(pos);
+      ++depth;
+      break;
+    }
+    case ExprOp::NEG:
+      need(0, 1);
+      builder.opNeg();
+      break;
+    case ExprOp::ADD: need(0, 2); builder.opAdd(); --depth; break;
+    case ExprOp::SUB: need(0, 2); builder.opSub(); --depth; break;
+    case ExprOp::MUL: need(0, 2); builder.opMul(); --depth; break;
+    case ExprOp::DIV: need(0, 2); builder.opDiv(); --depth; break;
+    case ExprOp::POW: need(0, 2); builder.opPow(); --depth; break;
+    case ExprOp::EQ: need(0, 2); builder.opEq(); --depth; break;
+    case ExprOp::NE: need(0, 2); builder.opNe(); --depth; break;
+    case ExprOp::LT: need(0, 2); builder.opLt(); --depth; break;
+    case ExprOp::LE: need(0, 2); builder.opLe(); --depth; break;
+    case ExprOp::GT: need(0, 2); builder.opGt(); --depth; break;
+    case ExprOp::GE: need(0, 2); builder.opGe(); --depth; break;
+    case ExprOp::BROKEN_REFERENCE:
+      builder.valBrokenReference();
+      ++depth;
+      break;
+    default:
+      throw std::invalid_argument("Unknown opcode in formula program");
+    }
+  }
+  if (depth != 1)
+    throw std::invalid_argument("Malformed formula program");
+}
+
+CCell CCell::restore(type contentType, std::string source, double number, std::string_view program) // Rebuilds cell from snapshot data
+{
+  CCell cell;
+  cell.content_type = contentType;
+  if (contentType == NUMERIC)
+    cell.content = number;
+  else if (contentType == TEXT)
+  {
+    cell.content = CText(std::move(source));
+    return cell;
+  }
+  else if (!program.empty()) // Empty program stands for formula that failed to compile
+  {
+    replay_program(program, cell.formula);
+    cell.formula.sortReferences();
+  }
+  cell.original_content = std::move(source);
+  return cell;
+}
+
+uint32_t CSnapshotView::checksum(std::string_view data)
+{
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : data)
+    hash = (hash ^ c) * 16777619u;
+  return hash;
+}
+
+void CSnapshotView::seal(std::string &data) // Appends block checksums of the whole data
+{
+  size_t size = data.size(), blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  data.reserve(size + blocks * 4 + 4);
+  for (size_t i = 0; i < blocks; ++i)
+    put_le<uint32_t>(data, crc32c(std::string_view(data.data() + i * BLOCK_SIZE, std::min(BLOCK_SIZE, size - i * BLOCK_SIZE))));
+  put_le<uint32_t>(data, blocks);
+}
+
+size_t CSnapshotView::unsealed(std::string_view data) // Size of data before the block checksums, npos when any block is damaged
+{
+  if (data.size() < 4)
+    return std::string_view::npos;
+  uint64_t blocks = get_le<uint32_t>(data.data() + data.size() - 4);
+  if (blocks * 4 + 4 > data.size())
+    return std::string_view::npos;
+  size_t size = data.size() - blocks * 4 - 4;
+  if ((size + BLOCK_SIZE - 1) / BLOCK_SIZE != blocks)
+    return std::string_view::npos;
+  for (size_t i = 0; i < blocks; ++i)
+    if (crc32c(data.substr(i * BLOCK_SIZE, std::min(BLOCK_SIZE, size - i * BLOCK_SIZE))) != get_le<uint32_t>(data.data() + size + i * 4))
+      return std::string_view::npos;
+  return size;
+}
+
+bool CSnapshotView::open(std::string_view data)
+{
+  if (data.size() < 8 || memcmp(data.data(), MAGIC, 4) != 0)
+    return false;
+  uint32_t version = get_le<uint32_t>(data.data() + 4);
+  size_t headerSize = version == 1 ? 40 : HEADER_SIZE; // Version 1 had no flags
+  if (version < 1 || version > VERSION)
+    return false;
+  if (version < 3)
+  {
+    if (data.size() < headerSize + 4 || checksum(data.substr(0, data.size() - 4)) != get_le<uint32_t>(data.data() + data.size() - 4))
+      return false;
+    data.remove_suffix(4);
+  }
+  else if (size_t size = unsealed(data); size != std::string_view::npos && size >= headerSize)
+    data = data.substr(0, size);
+  else
+    return false;
+
+  m_stringCount = get_le<uint64_t>(data.data() + 8);
+  m_stringBytes = get_le<uint64_t>(data.data() + 16);
+  m_programBytes = get_le<uint64_t>(data.data() + 24);
+  m_cellCount = get_le<uint64_t>(data.data() + 32);
+  uint32_t flags = version == 1 ? 0 : get_le<uint32_t>(data.data() + 40);
+  uint64_t available = data.size() - headerSize;
+  if (m_stringCount >= available / 8 || m_stringBytes > available || m_programBytes > available)
+    return false;
+  uint64_t sections = (m_stringCount + 1) * 8 + padded(m_stringBytes) + padded(m_programBytes);
+  if (sections > available)
+    return false;
+
+  m_offsets = data.data() + headerSize;
+  m_strings = m_offsets + (m_stringCount + 1) * 8;
+  m_programs = m_strings + padded(m_stringBytes);
+  m_cells = m_programs + padded(m_programBytes);
+  uint64_t cellBytes = available - sections, recordSize = RECORD_SIZE, valueSize = flags & FLAG_VALUES ? VALUE_SIZE : 0;
+  std::string_view stream;
+  if (flags & FLAG_COMPRESSED)
+  {
+    if (cellBytes < 8 || get_le<uint64_t>(m_cells) > cellBytes - 8 || padded(get_le<uint64_t>(m_cells)) > cellBytes - 8)
+      return false;
+    stream = std::string_view(m_cells + 8, get_le<uint64_t>(m_cells));
+    if (m_cellCount > stream.size() * 2) // Every cell takes at least 4 bits
+      return false;
+    cellBytes -= 8 + padded(stream.size());
+    recordSize = 0;
+  }
+  if (recordSize + valueSize == 0 ? cellBytes != 0 : (m_cellCount > cellBytes / (recordSize + valueSize) || m_cellCount * (recordSize + valueSize) != cellBytes))
+    return false;
+  m_values = flags & FLAG_VALUES ? data.data() + data.size() - m_cellCount * VALUE_SIZE : nullptr;
+  for (uint64_t i = 0; i < m_stringCount; ++i)
+  {
+    uint64_t begin = get_le<uint64_t>(m_offsets + i * 8), end = get_le<uint64_t>(m_offsets + i * 8 + 8);
+    if (begin > end || end > m_stringBytes)
+      return false;
+  }
+
+  if (flags & FLAG_COMPRESSED)
+  {
+    auto expanded = std::make_shared<std::string>();
+    if (!expand_cells(stream, m_cellCount, *expanded))
+      return false;
+    m_expanded = std::move(expanded);
+    m_cells = m_expanded->data();
+  }
+  return true;
+}
+
+std::string_view CSnapshotView::string(uint32_t id) const
+{
+  if (id >= m_stringCount)
+    throw std::invalid_argument("Invalid string id in snapshot");
+  uint64_t begin = get_le<uint64_t>(m_offsets + uint64_t(id) * 8), end = get_le<uint64_t>(m_offsets + uint64_t(id) * 8 + 8);
+  return std::string_view(m_strings + begin, end - begin);
+}
+
+std::string_view CSnapshotView::program(uint64_t offset) const
+{
+  if (offset > m_programBytes || m_programBytes - offset < 4)
+    throw std::invalid_argument("Invalid program offset in snapshot");
+  uint32_t length = get_le<uint32_t>(m_programs + offset);
+  if (m_programBytes - offset - 4 < length)
+    throw std::invalid_argument("Invalid program length in snapshot");
+  return std::string_view(m_programs + offset + 4, length);
+}
+
+uint64_t CSnapshotView::lowerBound(unsigned int row, unsigned int column) const // Index of first record not before (row, column)
+{
+  uint64_t low = 0, high = m_cellCount;
+  while (low < high)
+  {
+    uint64_t middle = low + (high - low) / 2;
+    if (std::make_pair(this->row(middle), this->column(middle)) < std::make_pair(row, column))
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+std::optional<uint64_t> CSnapshotView::find(unsigned int row, unsigned int column) const
+{
+  uint64_t index = lowerBound(row, column);
+  if (index < m_cellCount && this->row(index) == row && this->column(index) == column)
+    return index;
+  return std::nullopt;
+}
+
+CEvalValue CSnapshotView::value(uint64_t index) const // Value persisted at save time, see FLAG_VALUES
+{
+  const char *rec = m_values + index * VALUE_SIZE;
+  switch (get_le<uint32_t>(rec))
+  {
+  case 1:
+    return get_double(rec + 8);
+  case 2:
+    return CText(std::string(string(get_le<uint32_t>(rec + 4))));
+  default:
+    return CEvalValue();
+  }
+}
+
+CCell CSnapshotView::cell(uint64_t index) const
+{
+  const char *rec = record(index);
+  uint32_t type = get_le<uint32_t>(rec + 8), stringId = get_le<uint32_t>(rec + 12);
+  uint64_t payload = get_le<uint64_t>(rec + 16);
+
+  switch (type)
+  {
+  case CCell::NUMERIC:
+  {
+    double number = get_double(rec + 16);
+    return CCell::restore(CCell::NUMERIC, stringId == NO_STRING ? number_to_text(number) : std::string(string(stringId)), number, {});
+  }
+  case CCell::TEXT:
+    return CCell::restore(CCell::TEXT, std::string(string(stringId)), 0, {});
+  case CCell::FORMULA:
+    return CCell::restore(CCell::FORMULA, std::string(string(stringId)), 0, program(payload));
+  default:
+    throw std::invalid_argument("Invalid cell type in snapshot");
+  }
+}
+
+bool CSpreadsheet::saveBinary(std::ostream &os) const
+{
+  return writeSnapshot(os, nullptr);
+}
+
+bool CSpreadsheet::saveBinary(std::ostream &os, bool withValues) // Optionally persists computed values, so loaded sheet does not recalculate
+{
+  if (!withValues)
+    return writeSnapshot(os, nullptr);
+  CEvalScope scope(*this);
+  std::function<CEvalValue(const CPos &)> valueOf = [this](const CPos &pos)
+  { return evaluate(pos); };
+  return writeSnapshot(os, &valueOf);
+}
+
+bool CSpreadsheet::writeSnapshot(std::ostream &os, const std::function<CEvalValue(const CPos &)> *valueOf) const
+{
+  std::unordered_map<std::string, uint32_t> stringIds;
+  std::vector<uint64_t> stringOffsets = {0};
+  std::string strings, programs, cells, values;
+  std::unordered_map<uint32_t, uint64_t> programOffsets; // Keyed by source string id, equal sources compile to equal programs
+  uint64_t cellCount = 0;
+
+  auto intern = [&](const std::string &str)
+  {
+    auto [it, inserted] = stringIds.try_emplace(str, uint32_t(stringOffsets.size() - 1));
+    if (inserted)
+    {
+      strings += str;
+      stringOffsets.push_back(strings.size());
+    }
+    return it->second;
+  };
+
+  visitAllCells([&](const CPos &pos, const CCell &cell)
+             {
+    uint32_t stringId = CSnapshotView::NO_STRING;
+    uint64_t payload = 0;
+    switch (cell.get_type())
+    {
+    case CCell::NUMERIC:
+    {
+      double number = std::get<double>(cell.getValue(nullptr));
+      if (CNumberText(number).view() != cell.getContent())
+        stringId = intern(cell.getContent());
+      memcpy(&payload, &number, sizeof(payload));
+      break;
+    }
+    case CCell::TEXT:
+      stringId = intern(cell.getContent());
+      break;
+    case CCell::FORMULA:
+    {
+      stringId = intern(cell.getContent());
+      auto [it, inserted] = programOffsets.try_emplace(stringId, programs.size());
+      if (inserted)
+      {
+        std::string program;
+        if (ExprPtr expression = cell.getExpression())
+          expression->serialize(program);
+        put_le<uint32_t>(programs, program.size());
+        programs += program;
+      }
+      payload = it->second;
+      break;
+    }
+    default:
+      return; // Cleared cell, nothing to store
+    }
+    put_le<uint32_t>(cells, pos.row);
+    put_le<uint32_t>(cells, pos.column);
+    put_le<uint32_t>(cells, cell.get_type());
+    put_le<uint32_t>(cells, stringId);
+    put_le<uint64_t>(cells, payload);
+    ++cellCount;
+
+    if (!valueOf)
+      return;
+    CEvalValue value = (*valueOf)(pos);
+    double number = std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    put_le<uint32_t>(values, value.index());
+    put_le<uint32_t>(values, std::holds_alternative<CText>(value) ? intern(std::get<CText>(value).str()) : CSnapshotView::NO_STRING);
+    put_le<uint64_t>(values, bits); });
+
+  std::string data(CSnapshotView::MAGIC, 4);
+  put_le<uint32_t>(data, CSnapshotView::VERSION);
+  put_le<uint64_t>(data, stringOffsets.size() - 1);
+  put_le<uint64_t>(data, strings.size());
+  put_le<uint64_t>(data, programs.size());
+  put_le<uint64_t>(data, cellCount);
+  put_le<uint32_t>(data, (valueOf ? CSnapshotView::FLAG_VALUES : 0) | (m_compressSnapshots ? CSnapshotView::FLAG_COMPRESSED : 0));
+  put_le<uint32_t>(data, 0);
+  for (uint64_t offset : stringOffsets)
+    put_le<uint64_t>(data, offset);
+  strings.resize(CSnapshotView::padded(strings.size()), '\0');
+  programs.resize(CSnapshotView::padded(programs.size()), '\0');
+  data += strings;
+  data += programs;
+  if (m_compressSnapshots)
+  {
+    std::string stream = compress_cells(cells, cellCount);
+    put_le<uint64_t>(data, stream.size());
+    stream.resize(CSnapshotView::padded(stream.size()), '\0');
+    data += stream;
+  }
+  else
+    data += cells;
+  data += values;
+  CSnapshotView::seal(data);
+
+  os.write(data.data(), data.size());
+  return bool(os);
+}
+
+std::shared_ptr<const CMappedFile> CMappedFile::open(const std::string &fileName)
+{
+  std::shared_ptr<CMappedFile> file(new CMappedFile());
+#if defined(__unix__) || defined(__APPLE__)
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat info;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+    addr = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // Mapping stays valid without the descriptor
+  if (addr == MAP_FAILED)
+    return nullptr;
+  file->m_data = std::string_view(static_cast<const char *>(addr), info.st_size);
+#else
+  std::ifstream ifs(fileName, std::ios::binary);
+  if (!ifs)
+    return nullptr;
+  file->m_buffer.assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  file->m_data = file->m_buffer;
+#endif
+  return file;
+}
+
+CMappedFile::~CMappedFile()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  if (!m_data.empty())
+    munmap(const_cast<char *>(m_data.data()), m_data.size());
+#endif
+}
+
+bool CSpreadsheet::loadMapped(const std::string &fileName) // Serves binary snapshot file in place, formulas are deserialized on first touch
+{
+  auto file = CMappedFile::open(fileName);
+  CSnapshotView snapshot;
+  if (!file || !snapshot.open(file->data()))
+    return false;
+
+  if (m_pager)
+    for (auto spilled = m_pager->spilled; const auto &entry : spilled)
+      if (!touchTile(entry.first * CTilePager::TILE_ROWS, true)) // Spill copies would hide the new file
+      {
+        trimTiles();
+        return false;
+      }
+  materializeAll(); // Only one file is mapped at a time, cells of previous one move to page
+  for (auto it = page.begin(); it != page.end();)
+  {
+    if (!snapshot.find(it->first.row, it->first.column))
+      ++it;
+    else
+      it = page.erase(it); // Loaded cells replace current ones, like load does
+  }
+  m_persisted.clear(); // Any formula may read a cell the file adds or replaces
+  m_dependents.clear();
+  m_file = std::move(file);
+  m_mapped = snapshot;
+  trimTiles();
+  return true;
+}
+
+bool CSpreadsheet::loadBinary(std::istream &is)
+{
+  std::string data = read_stream(is);
+  CSnapshotView snapshot;
+  if (!snapshot.open(data))
+    return false;
+
+  std::vector<CCell> cells;
+  cells.reserve(snapshot.cellCount());
+  try
+  {
+    for (uint64_t i = 0; i < snapshot.cellCount(); ++i)
+      cells.push_back(snapshot.cell(i));
+  }
+  catch (const std::invalid_argument &)
+  {
+    return false; // Nothing was written yet, so the sheet stays as it was
+  }
+
+  if (m_pager)
+    for (uint64_t i = 0; i < snapshot.cellCount(); ++i)
+      if (!touchTile(snapshot.row(i), false))
+      {
+        trimTiles();
+        return false;
+      }
+  bool fresh = page.empty() && !m_file && (!m_pager || m_pager->spilled.empty()); // Persisted values only hold when nothing outside the file can feed the formulas
+  auto hint = page.end();
+  for (uint64_t i = 0; i < snapshot.cellCount(); ++i)
+  {
+    CPos pos(snapshot.row(i), snapshot.column(i));
+    invalidate(pos);
+    touchTile(pos.row, true); // Resident since the check above
+    hint = page.insert_or_assign(hint, pos, std::move(cells[i]));
+    ++hint;
+  }
+
+  if (fresh && snapshot.hasValues())
+  {
+    auto persisted = m_persisted.end();
+    for (uint64_t i = 0; i < snapshot.cellCount(); ++i)
+      if (snapshot.type(i) == CCell::FORMULA)
+        persisted = std::next(m_persisted.emplace_hint(persisted, CPos(snapshot.row(i), snapshot.column(i)), snapshot.value(i)));
+  }
+  trimTiles();
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+bool CTilePager::write(uint32_t tile, std::map<CPos, CCell>::const_iterator first, std::map<CPos, CCell>::const_iterator last)
+{
+  std::string record;
+  put_le<uint32_t>(record, std::distance(first, last));
+  for (auto it = first; it != last; ++it)
+  {
+    const auto &[pos, cell] = *it;
+    std::string program;
+    put_le<uint32_t>(record, pos.row);
+    put_le<uint32_t>(record, pos.column);
+    record.push_back(char(cell.get_type()));
+    put_double(record, cell.get_type() == CCell::NUMERIC ? std::get<double>(cell.getValue(nullptr)) : 0);
+    if (cell.get_type() == CCell::FORMULA)
+      if (ExprPtr expression = cell.getExpression())
+        expression->serialize(program);
+    std::string source = cell.get_type() == CCell::EMPTY ? std::string() : cell.getContent();
+    put_le<uint32_t>(record, source.size());
+    record += source;
+    put_le<uint32_t>(record, program.size());
+    record += program;
+  }
+  put_le<uint32_t>(record, crc32c(record));
+
+  spill->seekp(0, std::ios::end);
+  uint64_t offset = spill->tellp();
+  spill->write(record.data(), record.size());
+  spill->flush(); // Write errors show up here rather than on some later read
+  if (!*spill)
+  {
+    spill->clear();
+    return false;
+  }
+  spilled[tile] = {offset, record.size()};
+  return true;
+}
+
+bool CTilePager::read(uint32_t tile, std::vector<std::pair<CPos, CCell>> &cells) const // Latest spill copy of tile, false when it cannot be read or is damaged
+{
+  cells.clear();
+  auto extent = spilled.find(tile);
+  if (extent == spilled.end())
+    return true;
+  std::string record(extent->second.second, '\0');
+  spill->seekg(extent->second.first);
+  spill->read(record.data(), record.size());
+  if (!*spill || record.size() < 8 || crc32c(std::string_view(record).substr(0, record.size() - 4)) != get_le<uint32_t>(record.data() + record.size() - 4))
+  {
+    spill->clear();
+    return false;
+  }
+
+  std::string_view rest = std::string_view(record).substr(4, record.size() - 8);
+  auto take = [&](size_t size)
+  {
+    if (rest.size() < size)
+      throw std::invalid_argument("Truncated spill record");
+    std::string_view part = rest.substr(0, size);
+    rest.remove_prefix(size);
+    return part;
+  };
+  try
+  {
+    for (uint32_t count = get_le<uint32_t>(record.data()); count > 0; --count)
+    {
+      unsigned int row = get_le<uint32_t>(take(4).data()), column = get_le<uint32_t>(take(4).data());
+      auto type = CCell::type(take(1)[0]);
+      double number = get_double(take(8).data());
+      std::string source(take(get_le<uint32_t>(take(4).data())));
+      std::string_view program = take(get_le<uint32_t>(take(4).data()));
+      cells.emplace_back(CPos(row, column), type == CCell::EMPTY ? CCell() : CCell::restore(type, std::move(source), number, program));
+    }
+  }
+  catch (const std::invalid_argument &)
+  {
+    cells.clear();
+    return false;
+  }
+  return true;
+}
+
+bool CSpreadsheet::enablePaging(const std::string &spillFileName, size_t memoryBudget) // Keeps about memoryBudget bytes of cells in page, the rest waits in spill file
+{
+  auto spill = std::make_shared<std::fstream>(spillFileName, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+  if (!*spill)
+    return false;
+  m_pager.emplace();
+  m_pager->spill = std::move(spill);
+  m_pager->budget = memoryBudget;
+  for (auto it = page.begin(); it != page.end(); it = tileEnd(it->first.row / CTilePager::TILE_ROWS))
+    touchTile(it->first.row, true);
+  trimTiles();
+  return true;
+}
+
+std::map<CPos, CCell>::iterator CSpreadsheet::tileEnd(uint32_t tile)
+{
+  uint64_t next = uint64_t(tile + 1) * CTilePager::TILE_ROWS;
+  return next > UINT_MAX ? page.end() : page.lower_bound(CPos(unsigned(next), 0));
+}
+
+bool CSpreadsheet::touchTile(unsigned int row, bool write) // Makes tile resident and most recently used, write marks it for spilling
+{ // False when the spill copy of the tile cannot be read, the tile then stays spilled and nothing changes
+  if (!m_pager)
+    return true;
+  uint32_t tile = row / CTilePager::TILE_ROWS;
+  auto it = m_pager->resident.find(tile);
+  if (it == m_pager->resident.end())
+  {
+    std::vector<std::pair<CPos, CCell>> cells;
+    if (!m_pager->read(tile, cells))
+      return false;
+    for (auto &[pos, cell] : cells)
+      page.emplace(std::move(pos), std::move(cell));
+    it = m_pager->resident.try_emplace(tile).first;
+  }
+  else if (it->second.used == m_pager->clock)
+  {
+    it->second.dirty |= write;
+    return true; // Already most recent
+  }
+  else
+    m_pager->lru.erase(it->second.used);
+  it->second.dirty |= write;
+  it->second.used = ++m_pager->clock;
+  m_pager->lru.emplace(it->second.used, tile);
+  return true;
+}
+
+bool CSpreadsheet::touchTiles(const std::vector<std::pair<CPos, CCell>> &cells) // Brings in every tile the cells fall in before any of them is written
+{
+  if (!m_pager)
+    return true;
+  uint32_t last = UINT32_MAX;
+  for (const auto &[pos, cell] : cells)
+  {
+    if (pos.row / CTilePager::TILE_ROWS == last)
+      continue;
+    last = pos.row / CTilePager::TILE_ROWS;
+    if (!touchTile(pos.row, false))
+    {
+      trimTiles();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CSpreadsheet::spillReadable(uint64_t top, uint64_t bottom) const // False when a tile of rows top to bottom - 1 is only in the spill file and its copy is damaged
+{ // Checked before copies and fills, which are too large to bring in at once
+  if (!m_pager)
+    return true;
+  std::vector<std::pair<CPos, CCell>> cells;
+  for (const auto &[tile, extent] : m_pager->spilled)
+    if (!m_pager->resident.count(tile) && uint64_t(tile + 1) * CTilePager::TILE_ROWS > top && uint64_t(tile) * CTilePager::TILE_ROWS < bottom &&
+        !m_pager->read(tile, cells))
+      return false;
+  return true;
+}
+
+void CSpreadsheet::trimTiles() // Evicts least recently used tiles until estimate fits the budget, only between API calls
+{
+  if (!m_pager || m_eval)
+    return;
+  while (!m_pager->lru.empty() && page.size() * CTilePager::CELL_BYTES + m_pager->resident.size() * CTilePager::TILE_BYTES > m_pager->budget)
+  {
+    auto oldest = m_pager->lru.begin();
+    uint32_t tile = oldest->second;
+    auto first = page.lower_bound(CPos(tile * CTilePager::TILE_ROWS, 0)), last = tileEnd(tile);
+    if (m_pager->resident[tile].dirty && first == last)
+      m_pager->spilled.erase(tile);
+    else if (m_pager->resident[tile].dirty && !m_pager->write(tile, first, last))
+      return; // Spill file failed, tile stays resident
+    page.erase(first, last);
+    m_pager->resident.erase(tile);
+    m_pager->lru.erase(oldest);
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+/* Journal of edits, one record per setCell, setCells, copyRect, fill or row and column insertion or deletion, all integers little-endian:
+ *   u8 kind, u32 payload length, payload, u32 FNV-1a checksum of kind, length and payload
+ *   JOURNAL_SET  payload is u32 row, u32 column and the contents
+ *   JOURNAL_BATCH payload is u32 cell count, then u32 row, u32 column, u32 contents length and the contents of each cell
+ *   JOURNAL_COPY payload is u32 destination row and column, source row and column, width and height
+ *   JOURNAL_FILL payload is u32 source row and column, width, height and count, u8 'D' or 'R' for direction, f64 step
+ *   JOURNAL_SHIFT payload is u8 'R' or 'C' for rows or columns, u32 index and i32 count, negative for deletion
+ * Loads are not journaled, follow them with compact.
+ */
+bool CSpreadsheet::journal(char kind, const std::string &payload)
+{
+  if (!m_journal.os)
+    return true;
+  std::string record(1, kind);
+  put_le<uint32_t>(record, payload.size());
+  record += payload;
+  put_le<uint32_t>(record, CSnapshotView::checksum(record));
+  m_journal.os->write(record.data(), record.size());
+  m_journal.os->flush();
+  return bool(*m_journal.os);
+}
+
+bool CSpreadsheet::journalSet(const CPos &pos, std::string_view contents)
+{
+  if (!m_journal.os)
+    return true;
+  std::string payload;
+  put_le<uint32_t>(payload, pos.row);
+  put_le<uint32_t>(payload, pos.column);
+  payload += contents;
+  return journal(JOURNAL_SET, payload);
+}
+
+bool CSpreadsheet::journalBatch(std::span<const std::pair<CPos, std::string>> cells)
+{
+  if (!m_journal.os)
+    return true;
+  std::string payload;
+  put_le<uint32_t>(payload, cells.size());
+  for (const auto &[pos, contents] : cells)
+  {
+    put_le<uint32_t>(payload, pos.row);
+    put_le<uint32_t>(payload, pos.column);
+    put_le<uint32_t>(payload, contents.size());
+    payload += contents;
+  }
+  return journal(JOURNAL_BATCH, payload);
+}
+
+static bool read_journal_batch(std::string_view payload, std::vector<std::pair<CPos, std::string>> *cells) // Checks the layout, fills cells if given
+{
+  if (payload.size() < 4)
+    return false;
+  uint32_t count = get_le<uint32_t>(payload.data());
+  payload.remove_prefix(4);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (payload.size() < 12 || payload.size() - 12 < get_le<uint32_t>(payload.data() + 8))
+      return false;
+    uint32_t length = get_le<uint32_t>(payload.data() + 8);
+    if (cells)
+      cells->emplace_back(CPos(get_le<uint32_t>(payload.data()), get_le<uint32_t>(payload.data() + 4)), std::string(payload.substr(12, length)));
+    payload.remove_prefix(12 + length);
+  }
+  return payload.empty();
+}
+
+bool CSpreadsheet::replayJournal(std::istream &is) // Applies journaled edits in order, incomplete last record of interrupted append is ignored
+{
+  std::string data = read_stream(is);
+  std::vector<std::string_view> records;
+  size_t i = 0;
+  while (data.size() - i >= 5)
+  {
+    uint32_t length = get_le<uint32_t>(data.data() + i + 1);
+    if (data.size() - i - 5 < uint64_t(length) + 4)
+      break; // Torn tail
+    std::string_view record(data.data() + i, 5 + length);
+    if (CSnapshotView::checksum(record) != get_le<uint32_t>(data.data() + i + 5 + length))
+      return false;
+    if (!(record[0] == JOURNAL_SET && length >= 8) && !(record[0] == JOURNAL_COPY && length == 24) && !(record[0] == JOURNAL_FILL && length == 29) &&
+        !(record[0] == JOURNAL_SHIFT && length == 9) && !(record[0] == JOURNAL_BATCH && read_journal_batch(record.substr(5), nullptr)))
+      return false;
+    records.push_back(record);
+    i += 9 + length;
+  }
+
+  CJournalLink replaying;
+  std::swap(replaying.os, m_journal.os); // Replayed edits are already in some journal
+  bool ok = true;
+  for (std::string_view record : records)
+  {
+    const char *payload = record.data() + 5;
+    if (record[0] == JOURNAL_SET)
+      ok &= setCell(CPos(get_le<uint32_t>(payload), get_le<uint32_t>(payload + 4)), std::string(record.substr(13)));
+    else if (record[0] == JOURNAL_BATCH)
+    {
+      std::vector<std::pair<CPos, std::string>> cells;
+      read_journal_batch(record.substr(5), &cells);
+      ok &= setCells(cells);
+    }
+    else if (record[0] == JOURNAL_COPY)
+      copyRect(CPos(get_le<uint32_t>(payload), get_le<uint32_t>(payload + 4)), CPos(get_le<uint32_t>(payload + 8), get_le<uint32_t>(payload + 12)),
+               int(get_le<uint32_t>(payload + 16)), int(get_le<uint32_t>(payload + 20)));
+    else if (record[0] == JOURNAL_SHIFT)
+      ok &= shiftLines({payload[0] == 'R', get_le<uint32_t>(payload + 1), int32_t(get_le<uint32_t>(payload + 5))});
+    else
+      ok &= fill(CPos(get_le<uint32_t>(payload), get_le<uint32_t>(payload + 4)), int(get_le<uint32_t>(payload + 8)), int(get_le<uint32_t>(payload + 12)),
+                 int(get_le<uint32_t>(payload + 16)), payload[20] == 'D', get_double(payload + 21));
+  }
+  std::swap(replaying.os, m_journal.os);
+  return ok;
+}
+
+bool CSpreadsheet::compact(std::ostream &base, std::ostream *journal) // Folds journaled edits into new base snapshot and continues in fresh journal
+{
+  if (!saveBinary(base))
+    return false;
+  m_journal.os = journal;
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+#ifndef __PROGTEST__
+#include <chrono>
+
+bool                                   valueMatch                              ( const CValue                        & r,
+                                                                                 const CValue                        & s )
+
+{
+  if ( r . index () != s . index () )
+    return false;
+  if ( r . index () == 0 )
+    return true;
+  if ( r . index () == 2 )
+    return std::get<std::string> ( r ) == std::get<std::string> ( s );
+  if ( std::isnan ( std::get<double> ( r ) ) && std::isnan ( std::get<double> ( s ) ) )
+    return true;
+  if ( std::isinf ( std::get<double> ( r ) ) && std::isinf ( std::get<double> ( s ) ) )
+    return ( std::get<double> ( r ) < 0 && std::get<double> ( s ) < 0 )
+           || ( std::get<double> ( r ) > 0 && std::get<double> ( s ) > 0 );
+  return fabs ( std::get<double> ( r ) - std::get<double> ( s ) ) <= 1e8 * DBL_EPSILON * fabs ( std::get<double> ( r ) );
+}
+
+//==============================================================================================================================
+
+
+
+//==============================================================================================================================
+
+
+void basic_tests(){ 
+  CSpreadsheet x0, x1, x2, x3;
+  std::ostringstream oss;
+  std::istringstream iss;
+  std::string data;
+  assert ( x0 . setCell ( CPos ( "A1" ), "10" ) );
+  assert ( x0 . setCell ( CPos ( "A2" ), "20.5" ) );
+  assert ( x0 . setCell ( CPos ( "A3" ), "3e1" ) );
+  assert ( x0 . setCell ( CPos ( "A4" ), "=40" ) );
+  assert ( x0 . setCell ( CPos ( "A5" ), "=5e+1" ) );
+  assert ( x0 . setCell ( CPos ( "A6" ), "raw text with any characters, including a quote \" or a newline\n" ) );
+  assert ( x0 . setCell ( CPos ( "A7" ), "=\"quoted string, quotes must be doubled: \"\". Moreover, backslashes are needed for C++.\"" ) );
+
+  assert ( x0 . setCell ( CPos ( "A8" ), "=3 + 4 * 20" ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "A8" ) ), CValue ( 83.0 ) ) );
+
+  assert ( valueMatch ( x0 . getValue ( CPos ( "A1" ) ), CValue ( 10.0 ) ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "A2" ) ), CValue ( 20.5 ) ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "A3" ) ), CValue ( 30.0 ) ) );
+
+  assert ( x0 . setCell ( CPos ( "A9" ), "40" ) );
+  assert ( x0 . setCell ( CPos ( "B9" ), "2" ) );
+
+  assert ( x0 . setCell ( CPos ( "A10" ), "5" ) );
+
+  assert ( x0 . setCell ( CPos ( "B1" ), "=A1+A2*A3" ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "B1" ) ), CValue ( 625.0 ) ) );
+
+  assert ( x0 . setCell ( CPos ( "B2" ), "=A2-A1" ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "B2" ) ), CValue ( 10.5 ) ) );
+
+  assert ( x0 . setCell ( CPos ( "BBWB1" ), "=10" ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "BBWB1" ) ), CValue ( 10.0 ) ) );
+
+  x0 . getValue ( CPos ( "A4" ) );
+  x0 . getValue ( CPos ( "A5" ) );
+  x0 . getValue ( CPos ( "A6" ) );
+  x0 . getValue ( CPos ( "A7" ) );
+
+  assert ( x2 . setCell ( CPos ( "A1" ), "= A4 + A7" ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "A1" ) ), CValue () ) );
+
+  assert ( x2 . setCell ( CPos ( "A3" )," 10."));
+  assert ( x2 . setCell ( CPos ( "A4" )," 30."));
+  assert ( x2 . setCell ( CPos ( "A5" )," 40."));
+
+  assert ( x2 . setCell ( CPos ( "D0" ), "10" ) );
+  assert ( x2 . setCell ( CPos ( "D1" ), "20" ) );
+  assert ( x2 . setCell ( CPos ( "D2" ), "30" ) );
+  assert ( x2 . setCell ( CPos ( "D3" ), "40" ) );
+  assert ( x2 . setCell ( CPos ( "D4" ), "50" ) );
+  assert ( x2 . setCell ( CPos ( "E0" ), "60" ) );
+  assert ( x2 . setCell ( CPos ( "E1" ), "70" ) );
+  assert ( x2 . setCell ( CPos ( "E2" ), "80" ) );
+  assert ( x2 . setCell ( CPos ( "E3" ), "90" ) );
+  assert ( x2 . setCell ( CPos ( "E4" ), "100" ) );
+  assert ( x2 . setCell ( CPos ( "F10" ), "110" ) );
+  assert ( x2 . setCell ( CPos ( "F11" ), "120" ) );
+  assert ( x2 . setCell ( CPos ( "F12" ), "=130" ) );
+  assert ( x2 . setCell ( CPos ( "F13" ), "=140" ) );
+  x2 . copyRect ( CPos ( "G11" ), CPos ( "F10" ), 1, 4 );
+
+  assert ( valueMatch ( x2 . getValue ( CPos ( "F10" ) ), CValue ( 110.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "F11" ) ), CValue ( 120.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "F12" ) ), CValue ( 130.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "F13" ) ), CValue ( 140.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "F14" ) ), CValue() ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "G10" ) ), CValue() ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "G11" ) ), CValue ( 110.0 ) ) ); 
+  assert ( valueMatch ( x2 . getValue ( CPos ( "G12" ) ), CValue ( 120.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "G13" ) ), CValue ( 130.0 ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "G14" ) ), CValue ( 140.0 ) ) );
+
+  x2. copyRect ( CPos ( "B3" ), CPos ( "A3" ), 1, 3 );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "B3" ) ), CValue ( 10. ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "B4" ) ), CValue ( 30. ) ) );
+  assert ( valueMatch ( x2 . getValue ( CPos ( "B5" ) ), CValue ( 40. ) ) );
+
+  assert ( x1 . setCell ( CPos ( "A0" ), "\n\n\n\n\\\\" ) );
+  assert ( x1 . setCell ( CPos ( "A1" ), "\n \n guten tag \\n" ) );
+
+  oss . clear ();
+  oss . str ( "" );
+  assert ( x1 . save ( oss ) );
+  data = oss . str ();
+  iss . clear ();
+  iss . str ( data );
+  assert ( x3 . load ( iss ) );
+
+  assert ( valueMatch ( x3 . getValue ( CPos ( "A0" ) ), CValue ( "\n\n\n\n\\\\" ) ) );
+  assert ( valueMatch ( x3 . getValue ( CPos ( "A1" ) ), CValue ( "\n \n guten tag \\n" ) ) );
+
+  assert ( x0 . setCell ( CPos ( "A1" ), "10" ) );
+  assert ( x0 . setCell ( CPos ( "A2" ), "0" ) );
+  assert ( x0 . setCell ( CPos ( "A3" ), "=A1/A2" ) );
+
+    assert ( valueMatch ( x0 . getValue ( CPos ( "A3" ) ), CValue () ) );
+  assert ( x0 . setCell ( CPos ( "A2" ), "Hello\n" ) );
+  assert ( x0 . setCell ( CPos ( "A3" ), "its me" ) );
+  assert ( x0 . setCell ( CPos ( "A1" ), "=A2+A3" ) );
+  assert ( valueMatch ( x0 . getValue ( CPos ( "A1" ) ), CValue ("Hello\nits me") ) );
+  assert ( x0 . setCell ( CPos ( "A3" ), "3" ) );
+  assert ( x0 . setCell ( CPos ( "A1" ), "=A2+A3" ) );
+
+
+  assert ( x1 . setCell ( CPos ( "A0" ), "22" ) );
+  assert ( x1 . setCell ( CPos ( "A1" ), "99" ) );
+  x1 . copyRect ( CPos ( "A0" ), CPos ( "A1" ), 1, 1 );
+  assert ( valueMatch ( x1 . getValue ( CPos ( "A0" ) ), x1 . getValue ( CPos ( "A1" ) ) ) );
+
+};
+
+void save_load_tests(){
+  CSpreadsheet x0, x1;
+  std::ostringstream oss;
+  std::istringstream iss;
+  std::string data;
+
+  // Test 1: Save and Load a simple numeric value
+  x0.setCell(CPos("A1"), "123.456");
+  assert(x0.save(oss));
+  data = oss.str();
+  iss.str(data);
+  assert(x1.load(iss));
+  assert(valueMatch(x1.getValue(CPos("A1")), CValue(123.456)));
+
+  // Clear stream states and contents for the next test
+  oss.str("");
+  oss.clear();
+  iss.clear();
+
+  // Test 2: Save and Load a string value
+  x0.setCell(CPos("B1"), "\"Hello,\t world!\"");
+  assert(x0.save(oss));
+  data = oss.str();
+  iss.str(data);
+  assert(x1.load(iss));
+  assert(valueMatch(x1.getValue(CPos("B1")), CValue("\"Hello,\t world!\"")));
+
+  oss.str("");
+  oss.clear();
+  iss.clear();
+
+  // Test 3: Save and Load a formula (as a string for simplicity)
+  x0.setCell(CPos("C1"), "=\"SUM(A1,B1)\"");
+  assert(x0.save(oss));
+  data = oss.str();
+  iss.str(data);
+  assert(x1.load(iss));
+  assert(valueMatch(x1.getValue(CPos("C1")), CValue("SUM(A1,B1)")));
+
+  oss.str("");
+  oss.clear();
+  iss.clear();
+
+  // Test 4: Save and Load with special characters
+  x0.setCell(CPos("D1"), "\"New\\nLine and \\\"escaped\\\" quotes\"");
+  assert(x0.save(oss));
+  data = oss.str();
+  iss.str(data);
+  assert(x1.load(iss));
+  assert(valueMatch(x1.getValue(CPos("D1")), CValue("\"New\\nLine and \\\"escaped\\\" quotes\"")));
+
+  oss.str("");
+  oss.clear();
+  iss.clear();
+
+  // Test 5: Save and Load multiple cells
+  x0.setCell(CPos("A2"), "789.1011");
+  x0.setCell(CPos("B2"), "\"Another\\ \n \t \' \" \\\\ \a \b test\"");
+  x0.setCell(CPos("C2"), "=\"Another\\ \n \t \'  hello \\\\ \a \b test\"");
+
+  assert(x0.save(oss));
+  data = oss.str();
+  iss.str(data);
+  assert(x1.load(iss));
+  assert(valueMatch(x1.getValue(CPos("A2")), CValue(789.1011)));
+  assert(valueMatch(x1.getValue(CPos("B2")), CValue("\"Another\\ \n \t \' \" \\\\ \a \b test\"")));
+
+  assert(valueMatch(x1.getValue(CPos("C2")), CValue("Another\\ \n \t \'  hello \\\\ \a \b test")));
+
+  // Test 6: Markers inside contents, empty records and missing final separator
+  CSpreadsheet x2;
+  iss.clear();
+  iss.str("BUNKA1CONTCONT and BUNK inside\x1f\x1f\x1f" "BUNKB1CONT=A1+\"!\"\x1f" "BUNKC1CONT42");
+  assert(x2.load(iss));
+  assert(valueMatch(x2.getValue(CPos("A1")), CValue("CONT and BUNK inside")));
+  assert(valueMatch(x2.getValue(CPos("B1")), CValue("CONT and BUNK inside!")));
+  assert(valueMatch(x2.getValue(CPos("C1")), CValue(42.0)));
+
+  // Test 7: Record without markers fails the whole load
+  iss.clear();
+  iss.str("BUNKD1CONT1\x1f" "garbage\x1f");
+  assert(!x2.load(iss));
+  assert(valueMatch(x2.getValue(CPos("D1")), CValue()));
+
+
+  // Display results or log them
+  std::cout << "Save & load tests passed!" << std::endl;
+};
+
+void copyRect_tests() {
+    CSpreadsheet ss,x1;
+    std::ostringstream oss;
+    std::istringstream iss;
+    std::string data;
+
+    // Set up initial cells
+    assert(ss.setCell(CPos("A1"), "10"));
+    assert(ss.setCell(CPos("A2"), "20"));
+    assert(ss.setCell(CPos("A3"), "=A1+A2"));  // Formula should update when copied
+    assert(ss.setCell(CPos("B1"), "30"));
+    assert(ss.setCell(CPos("B2"), "=A2*2"));
+
+    // Test 1: Copy single cell with value
+    ss.copyRect(CPos("C1"), CPos("A1"), 1, 1);
+    assert(valueMatch(ss.getValue(CPos("C1")), CValue(10.0)));
+
+    // Test 2: Copy single cell with formula and check if the reference updates correctly
+    ss.copyRect(CPos("C3"), CPos("A3"), 1, 1);
+    assert(valueMatch(ss.getValue(CPos("C3")), CValue()));  // C3 should now be =C1+C2
+
+    // Test 3: Copy a range of cells including formulas
+    ss.copyRect(CPos("D1"), CPos("A1"), 2, 2);
+    assert(valueMatch(ss.getValue(CPos("D1")), CValue(10.0)));  // Copy of A1
+    assert(valueMatch(ss.getValue(CPos("D2")), CValue(20.0)));  // Copy of A2
+    assert(valueMatch(ss.getValue(CPos("E1")), CValue(30.0)));  // Copy of B1
+    assert(valueMatch(ss.getValue(CPos("E2")), CValue(40.0)));  // Should evaluate to 40 because E2 = D2*2
+
+    // Test 4: Overlapping regions (source and destination overlap)
+    ss.setCell(CPos("A4"), "100");
+    ss.copyRect(CPos("A5"), CPos("A4"), 1, 1);
+    assert(valueMatch(ss.getValue(CPos("A5")), CValue(100.0)));
+
+    // Test 5: Copy to a larger range than the source covers
+    ss.copyRect(CPos("C5"), CPos("A1"), 3, 3);  // Source is only 2x2
+    assert(valueMatch(ss.getValue(CPos("C5")), CValue(10.0)));  // A1
+    assert(valueMatch(ss.getValue(CPos("C6")), CValue(20.0)));  // A2
+    assert(valueMatch(ss.getValue(CPos("D5")), CValue(30.0)));  // B1
+    assert(valueMatch(ss.getValue(CPos("D6")), CValue(40.0)));  // B2
+    // Cells without explicit source should be empty or default
+    assert(valueMatch(ss.getValue(CPos("C7")), CValue(30.)));       // Beyond A3, should be empty
+    assert(valueMatch(ss.getValue(CPos("D7")), CValue()));       // Beyond B2, should be empty
+
+    // Test 6: Edge case - Copying an empty cell to a range
+    ss.copyRect(CPos("F1"), CPos("Z99"), 2, 2);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("F1")), CValue()));
+    assert(valueMatch(ss.getValue(CPos("F2")), CValue()));
+    assert(valueMatch(ss.getValue(CPos("G1")), CValue()));
+    assert(valueMatch(ss.getValue(CPos("G2")), CValue()));
+
+    assert(ss.setCell(CPos("A2"), "=\"N8+22\""));
+    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
+    ss.copyRect(CPos("Z99"), CPos("A2"), 2, 2);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("Z99")), CValue("N8+22")));
+
+    assert(ss.setCell(CPos("A2"), "=\"N8+22\""));
+    assert(ss.setCell(CPos("A3"), "=A2"));
+
+    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
+    ss.copyRect(CPos("Z99"), CPos("A3"), 2, 2);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("Z99")), CValue()));
+
+    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
+    ss.copyRect(CPos("Z99"), CPos("A2"), 2, 2);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("Z99")), CValue("N8+22")));
+
+
+    assert(ss.setCell(CPos("A3"), "30"));
+    assert(ss.setCell(CPos("F12"), "=A3"));
+    assert(ss.setCell(CPos("C5"), "=10"));
+
+  //  ss.copyRect(CPos("F12"), CPos("A3"), 1, 1);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("F12")), CValue(30.)));
+    ss.copyRect(CPos("G13"), CPos("F12"), 1, 1);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("G13")), CValue()));
+    ss.copyRect(CPos("H14"), CPos("G13"), 1, 1);  // Assuming Z99 is empty
+    assert(valueMatch(ss.getValue(CPos("H14")), CValue(10.)));
+
+      oss.str("");
+    oss.clear();
+    iss.clear();
+
+  // Test 4: Save and Load with special characters
+    CSpreadsheet s1;
+    assert(s1.setCell(CPos("A1"), "1"));
+    assert(s1.setCell(CPos("B1"), "2"));
+    assert(s1.setCell(CPos("C1"), "3"));
+    assert(s1.setCell(CPos("A2"), "4"));
+    assert(s1.setCell(CPos("B2"), "5"));
+    assert(s1.setCell(CPos("C2"), "6"));
+    assert(s1.setCell(CPos("A3"), "7"));
+    assert(s1.setCell(CPos("B3"), "8"));
+    assert(s1.setCell(CPos("C3"), "=A1+B1+C1+A2+B2+C2+A3+B3"));
+    assert(valueMatch(s1.getValue(CPos("C3")), 36.0));
+    s1.copyRect(CPos("B2"), CPos("A1"), 3, 3);
 
-void basic_tests(){ 
-  CSpreadsheet x0, x1, x2, x3;
-  std::ostringstream oss;
-  std::istringstream iss;
-  std::string data;
-  assert ( x0 . setCell ( CPos ( "A1" ), "10" ) );
-  assert ( x0 . setCell ( CPos ( "A2" ), "20.5" ) );
-  assert ( x0 . setCell ( CPos ( "A3" ), "3e1" ) );
-  assert ( x0 . setCell ( CPos ( "A4" ), "=40" ) );
-  assert ( x0 . setCell ( CPos ( "A5" ), "=5e+1" ) );
-  assert ( x0 . setCell ( CPos ( "A6" ), "raw text with any characters, including a quote \" or a newline\n" ) );
-  assert ( x0 . setCell ( CPos ( "A7" ), "=\"quoted string, quotes must be doubled: \"\". Moreover, backslashes are needed for C++.\"" ) );
+    assert(s1.setCell(CPos("A1"), "= A2 + A3"));
+    assert(s1.setCell(CPos("A2"), "= A4"));
+    assert(s1.setCell(CPos("A3"), "= A4"));
+    assert(s1.setCell(CPos("A4"), "100"));
 
-  assert ( x0 . setCell ( CPos ( "A8" ), "=3 + 4 * 20" ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "A8" ) ), CValue ( 83.0 ) ) );
+    assert(valueMatch(s1.getValue(CPos("A1")), 200.));
+    assert(valueMatch(s1.getValue(CPos("A2")), 100.));
+    assert(valueMatch(s1.getValue(CPos("A3")), 100.));
+    assert(valueMatch(s1.getValue(CPos("A4")), 100.));
 
-  assert ( valueMatch ( x0 . getValue ( CPos ( "A1" ) ), CValue ( 10.0 ) ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "A2" ) ), CValue ( 20.5 ) ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "A3" ) ), CValue ( 30.0 ) ) );
 
-  assert ( x0 . setCell ( CPos ( "A9" ), "40" ) );
-  assert ( x0 . setCell ( CPos ( "B9" ), "2" ) );
 
-  assert ( x0 . setCell ( CPos ( "A10" ), "5" ) );
+    std::cout << "CopyRect tests passed." << std::endl;
+}
 
-  assert ( x0 . setCell ( CPos ( "B1" ), "=A1+A2*A3" ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "B1" ) ), CValue ( 625.0 ) ) );
 
-  assert ( x0 . setCell ( CPos ( "B2" ), "=A2-A1" ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "B2" ) ), CValue ( 10.5 ) ) );
+void batch_tests() {
+    CSpreadsheet ss;
+    std::ostringstream oss;
+    std::istringstream iss;
 
-  assert ( x0 . setCell ( CPos ( "BBWB1" ), "=10" ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "BBWB1" ) ), CValue ( 10.0 ) ) );
+    // Test 1: Whole batch is applied, formulas see cells from the same batch
+    std::vector<std::pair<CPos, std::string>> batch = {
+        {CPos("A1"), "10"},
+        {CPos("A2"), "=A1*2"},
+        {CPos("A3"), "=A1+A2"},
+        {CPos("B1"), "hello"}};
+    assert(ss.setCells(batch));
+    assert(valueMatch(ss.getValue(CPos("A2")), CValue(20.0)));
+    assert(valueMatch(ss.getValue(CPos("A3")), CValue(30.0)));
+    assert(valueMatch(ss.getValue(CPos("B1")), CValue("hello")));
+
+    // Test 2: One unparsable cell rolls back the whole batch
+    std::vector<std::pair<CPos, std::string>> broken = {
+        {CPos("A1"), "99"},
+        {CPos("C1"), "=5"},
+        {CPos("A2"), "=A1+"}};
+    assert(!ss.setCells(broken));
+    assert(valueMatch(ss.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(ss.getValue(CPos("A2")), CValue(20.0)));
+    assert(valueMatch(ss.getValue(CPos("C1")), CValue()));
+
+    // Test 3: Later edits of the same cell win
+    std::vector<std::pair<CPos, std::string>> twice = {
+        {CPos("D1"), "1"},
+        {CPos("D1"), "2"}};
+    assert(ss.setCells(twice));
+    assert(valueMatch(ss.getValue(CPos("D1")), CValue(2.0)));
+
+    // Test 4: Load with a broken position leaves the sheet untouched
+    CSpreadsheet x1;
+    assert(x1.setCell(CPos("A1"), "5"));
+    iss.str("BUNKA1CONT7\x1f" "BUNK1ACONT8\x1f");
+    assert(!x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(5.0)));
+
+    std::cout << "Batch tests passed." << std::endl;
+}
 
-  x0 . getValue ( CPos ( "A4" ) );
-  x0 . getValue ( CPos ( "A5" ) );
-  x0 . getValue ( CPos ( "A6" ) );
-  x0 . getValue ( CPos ( "A7" ) );
 
-  assert ( x2 . setCell ( CPos ( "A1" ), "= A4 + A7" ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "A1" ) ), CValue () ) );
+void getValues_tests() {
+    CSpreadsheet ss;
+
+    assert(ss.setCell(CPos("B2"), "1"));
+    assert(ss.setCell(CPos("C2"), "=B2+1"));
+    assert(ss.setCell(CPos("B3"), "text"));
+    assert(ss.setCell(CPos("D3"), "=C2*B2+C2"));
+    assert(ss.setCell(CPos("E3"), "=E4"));
+    assert(ss.setCell(CPos("E4"), "=E3"));
+    assert(ss.setCell(CPos("A1"), "outside"));
+    assert(ss.setCell(CPos("F2"), "outside"));
+
+    // Test 1: Dense row-major matrix of a 4 x 3 rectangle B2:E4
+    std::vector<CValue> values = ss.getValues(CPos("B2"), 4, 3);
+    assert(values.size() == 12);
+    assert(valueMatch(values[0], CValue(1.0)));
+    assert(valueMatch(values[1], CValue(2.0)));
+    assert(valueMatch(values[2], CValue()));
+    assert(valueMatch(values[3], CValue()));
+    assert(valueMatch(values[4], CValue("text")));
+    assert(valueMatch(values[6], CValue(4.0)));
+    assert(valueMatch(values[7], CValue()));  // E3 is part of a cycle
+    assert(valueMatch(values[11], CValue())); // E4 is part of a cycle
+    for (size_t i = 0; i < values.size(); ++i)
+      assert(valueMatch(values[i], ss.getValue(CPos(2 + unsigned(i) / 4, 2 + unsigned(i) % 4))));
+
+    // Test 2: Degenerate rectangles
+    assert(ss.getValues(CPos("A1"), 0, 5).empty());
+    assert(ss.getValues(CPos("A1"), 3, -1).empty());
+
+    // Test 3: Long dependency chain is evaluated once per cell
+    CSpreadsheet chain;
+    assert(chain.setCell(CPos("A1"), "1"));
+    for (unsigned row = 2; row <= 60; ++row)
+      assert(chain.setCell(CPos(row, 1), "=A" + std::to_string(row - 1) + "+A" + std::to_string(row - 1)));
+    assert(valueMatch(chain.getValue(CPos("A60")), CValue(std::pow(2.0, 59))));
+    assert(valueMatch(chain.getValues(CPos("A60"), 1, 1)[0], CValue(std::pow(2.0, 59))));
+
+    std::cout << "GetValues tests passed." << std::endl;
+}
 
-  assert ( x2 . setCell ( CPos ( "A3" )," 10."));
-  assert ( x2 . setCell ( CPos ( "A4" )," 30."));
-  assert ( x2 . setCell ( CPos ( "A5" )," 40."));
 
-  assert ( x2 . setCell ( CPos ( "D0" ), "10" ) );
-  assert ( x2 . setCell ( CPos ( "D1" ), "20" ) );
-  assert ( x2 . setCell ( CPos ( "D2" ), "30" ) );
-  assert ( x2 . setCell ( CPos ( "D3" ), "40" ) );
-  assert ( x2 . setCell ( CPos ( "D4" ), "50" ) );
-  assert ( x2 . setCell ( CPos ( "E0" ), "60" ) );
-  assert ( x2 . setCell ( CPos ( "E1" ), "70" ) );
-  assert ( x2 . setCell ( CPos ( "E2" ), "80" ) );
-  assert ( x2 . setCell ( CPos ( "E3" ), "90" ) );
-  assert ( x2 . setCell ( CPos ( "E4" ), "100" ) );
-  assert ( x2 . setCell ( CPos ( "F10" ), "110" ) );
-  assert ( x2 . setCell ( CPos ( "F11" ), "120" ) );
-  assert ( x2 . setCell ( CPos ( "F12" ), "=130" ) );
-  assert ( x2 . setCell ( CPos ( "F13" ), "=140" ) );
-  x2 . copyRect ( CPos ( "G11" ), CPos ( "F10" ), 1, 4 );
+void visitCells_tests() {
+    CSpreadsheet ss;
+
+    assert(ss.setCell(CPos("B2"), "1"));
+    assert(ss.setCell(CPos("D2"), "2"));
+    assert(ss.setCell(CPos("C3"), "=B2"));
+    assert(ss.setCell(CPos("B4"), "text"));
+    assert(ss.setCell(CPos("A3"), "left of rectangle"));
+    assert(ss.setCell(CPos("E3"), "right of rectangle"));
+    assert(ss.setCell(CPos("C5"), "below rectangle"));
+
+    // Test 1: Row-major order over B2:D4
+    std::vector<std::string> codes;
+    ss.visitCells(CPos("B2"), 3, 3, [&](const CPos &pos, const CCell &)
+                  { codes.push_back(pos.getCode()); });
+    assert((codes == std::vector<std::string>{"B2", "D2", "C3", "B4"}));
+
+    // Test 2: Column-major order over the same rectangle
+    codes.clear();
+    ss.visitCells(CPos("B2"), 3, 3, [&](const CPos &pos, const CCell &)
+                  { codes.push_back(pos.getCode()); }, true);
+    assert((codes == std::vector<std::string>{"B2", "B4", "C3", "D2"}));
+
+    // Test 3: Cells are handed over as stored
+    ss.visitCells(CPos("C3"), 1, 1, [&](const CPos &, const CCell &cell)
+                  { assert(cell.getContent() == "=B2"); });
+
+    // Test 4: Sparse 1M x 1000 region only costs the occupied cells
+    CSpreadsheet sparse;
+    for (unsigned row = 0; row < 1000000; row += 10000)
+    {
+      assert(sparse.setCell(CPos(row, 500), "1"));
+      assert(sparse.setCell(CPos(row, 5000), "outside"));
+    }
+    int visited = 0;
+    sparse.visitCells(CPos(0, 1), 1000, 1000000, [&](const CPos &, const CCell &)
+                      { ++visited; });
+    assert(visited == 100);
 
-  assert ( valueMatch ( x2 . getValue ( CPos ( "F10" ) ), CValue ( 110.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "F11" ) ), CValue ( 120.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "F12" ) ), CValue ( 130.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "F13" ) ), CValue ( 140.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "F14" ) ), CValue() ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "G10" ) ), CValue() ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "G11" ) ), CValue ( 110.0 ) ) ); 
-  assert ( valueMatch ( x2 . getValue ( CPos ( "G12" ) ), CValue ( 120.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "G13" ) ), CValue ( 130.0 ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "G14" ) ), CValue ( 140.0 ) ) );
+    std::cout << "VisitCells tests passed." << std::endl;
+}
 
-  x2. copyRect ( CPos ( "B3" ), CPos ( "A3" ), 1, 3 );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "B3" ) ), CValue ( 10. ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "B4" ) ), CValue ( 30. ) ) );
-  assert ( valueMatch ( x2 . getValue ( CPos ( "B5" ) ), CValue ( 40. ) ) );
 
-  assert ( x1 . setCell ( CPos ( "A0" ), "\n\n\n\n\\\\" ) );
-  assert ( x1 . setCell ( CPos ( "A1" ), "\n \n guten tag \\n" ) );
+void binary_snapshot_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+    std::string data;
 
-  oss . clear ();
-  oss . str ( "" );
-  assert ( x1 . save ( oss ) );
-  data = oss . str ();
-  iss . clear ();
-  iss . str ( data );
-  assert ( x3 . load ( iss ) );
+    assert(x0.setCell(CPos("A1"), "10"));
+    assert(x0.setCell(CPos("A2"), " 20.50"));
+    assert(x0.setCell(CPos("A3"), "3e1"));
+    assert(x0.setCell(CPos("B1"), "text with \x1f, \0 and \n inside"s));
+    assert(x0.setCell(CPos("B2"), "text with \x1f, \0 and \n inside"));
+    assert(x0.setCell(CPos("C1"), "=A1+A2*A3"));
+    assert(x0.setCell(CPos("C2"), "= -$A1 ^ 2 - A$2 / 2   "));
+    assert(x0.setCell(CPos("C3"), "=\"quo\"\"ted\" + $A$3"));
+    assert(x0.setCell(CPos("C4"), "=A1+A2*A3"));
+    assert(x0.setCell(CPos("C5"), "=(A1<A2)+(A1<=A2)+(A1>A2)+(A1>=A2)+(A1=A2)+(A1<>A2)"));
+    assert(x0.setCell(CPos("D1"), "=D2"));
+    assert(x0.setCell(CPos("D2"), "=D1"));
+
+    // Test 1: Round trip keeps values and source text
+    assert(x0.saveBinary(oss));
+    data = oss.str();
+    iss.str(data);
+    assert(x1.loadBinary(iss));
+    for (const auto &[pos, cell] : x0.page)
+    {
+      assert(x1.page.at(pos).getContent() == cell.getContent());
+      assert(valueMatch(x1.getValue(pos), x0.getValue(pos)));
+    }
+    assert(x1.page.size() == x0.page.size());
+    assert(valueMatch(x1.getValue(CPos("C2")), CValue(-110.25)));
+    assert(valueMatch(x1.getValue(CPos("C3")), CValue("quo\"ted30")));
+    assert(valueMatch(x1.getValue(CPos("D1")), CValue()));
+
+    // Test 2: Restored formulas keep their dependencies
+    assert(x1.setCell(CPos("A1"), "12"));
+    assert(valueMatch(x1.getValue(CPos("C1")), CValue(627.0)));
+    assert(valueMatch(x1.getValue(CPos("C2")), CValue(-154.25)));
+
+    // Test 3: Corruption anywhere is detected and the sheet stays untouched
+    assert(x2.setCell(CPos("A1"), "5"));
+    for (size_t i = 0; i < data.size(); i += 7)
+    {
+      std::string broken = data;
+      broken[i] ^= 0x5a;
+      iss.clear();
+      iss.str(broken);
+      assert(!x2.loadBinary(iss));
+    }
+    iss.clear();
+    iss.str(data.substr(0, data.size() - 1));
+    assert(!x2.loadBinary(iss));
+    iss.clear();
+    iss.str("");
+    assert(!x2.loadBinary(iss));
+    assert(x2.page.size() == 1);
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue(5.0)));
 
-  assert ( valueMatch ( x3 . getValue ( CPos ( "A0" ) ), CValue ( "\n\n\n\n\\\\" ) ) );
-  assert ( valueMatch ( x3 . getValue ( CPos ( "A1" ) ), CValue ( "\n \n guten tag \\n" ) ) );
+    std::cout << "Binary snapshot tests passed." << std::endl;
+}
+
+
+void mapped_snapshot_tests() {
+    const char *fileName = "mapped_snapshot_test.bin", *damagedName = "mapped_snapshot_damaged.bin";
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+
+    assert(x0.setCell(CPos("A1"), "10"));
+    assert(x0.setCell(CPos("A2"), "20.5"));
+    assert(x0.setCell(CPos("A3"), "some text"));
+    assert(x0.setCell(CPos("B1"), "=A1+A2"));
+    assert(x0.setCell(CPos("B2"), "=B1*2"));
+    assert(x0.setCell(CPos("C1"), "=C2"));
+    assert(x0.setCell(CPos("C2"), "=C1"));
+    assert(x0.setCell(CPos("F9"), "=99"));
+    assert(x0.saveBinary(oss));
+    {
+      std::ofstream ofs(fileName, std::ios::binary);
+      ofs << oss.str();
+    }
+
+    // Test 1: Values are served from the mapped file, existing cells are replaced
+    assert(x1.setCell(CPos("A1"), "replaced"));
+    assert(x1.setCell(CPos("Z1"), "kept"));
+    assert(x1.loadMapped(fileName));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(x1.getValue(CPos("A3")), CValue("some text")));
+    assert(valueMatch(x1.getValue(CPos("B2")), CValue(61.0)));
+    assert(valueMatch(x1.getValue(CPos("C1")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("Z1")), CValue("kept")));
+    assert(valueMatch(x1.getValue(CPos("D1")), CValue()));
+
+    // Test 2: Edits shadow the mapped cells
+    assert(x1.setCell(CPos("A1"), "12"));
+    assert(valueMatch(x1.getValue(CPos("B2")), CValue(65.0)));
+    std::vector<CValue> values = x1.getValues(CPos("A1"), 2, 2);
+    assert(valueMatch(values[0], CValue(12.0)) && valueMatch(values[1], CValue(32.5)));
+    assert(valueMatch(values[2], CValue(20.5)) && valueMatch(values[3], CValue(65.0)));
+
+    // Test 3: Copies and saves see mapped and stored cells alike
+    x1.copyRect(CPos("D1"), CPos("A1"), 2, 3);
+    assert(valueMatch(x1.getValue(CPos("E2")), CValue(65.0)));
+    assert(valueMatch(x1.getValue(CPos("D3")), CValue("some text")));
+    std::vector<std::string> codes;
+    x1.visitCells(CPos("A1"), 2, 3, [&](const CPos &pos, const CCell &)
+                  { codes.push_back(pos.getCode()); }, true);
+    assert((codes == std::vector<std::string>{"A1", "A2", "A3", "B1", "B2"}));
+    oss.str("");
+    assert(x1.save(oss));
+    std::istringstream iss(oss.str());
+    assert(x2.load(iss));
+    assert(valueMatch(x2.getValue(CPos("B2")), CValue(65.0)));
+    assert(valueMatch(x2.getValue(CPos("Z1")), CValue("kept")));
+
+    // Test 4: Missing or damaged files are rejected
+    assert(!x2.loadMapped("no_such_snapshot.bin"));
+    {
+      std::ofstream ofs(damagedName, std::ios::binary);
+      ofs << "BUNKA1CONT1" << char(31);
+    }
+    assert(!x2.loadMapped(damagedName));
+    std::remove(damagedName);
+
+    // Test 5: Mapping stays alive after the file is unlinked
+    std::remove(fileName);
+    assert(valueMatch(x1.getValue(CPos("F9")), CValue(99.0)));
+
+    // Test 6: Cells in the last row and column are saved, cleared cells are not
+    CSpreadsheet x3, x4, x5, x6;
+    assert(x3.setCell(CPos(INT_MAX, 1), "bottom"));
+    assert(x3.setCell(CPos(1, INT_MAX), "right"));
+    assert(x3.setCell(CPos(INT_MAX, INT_MAX), "corner"));
+    assert(x3.setCell(CPos("C1"), "=A0"));
+    x3.copyRect(CPos("C0"), CPos("C1")); // A-1 does not exist, so C0 is cleared
+    assert(x3.page.at(CPos("C0")).get_type() == CCell::EMPTY);
+    oss.str("");
+    assert(x3.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x4.load(iss));
+    oss.str("");
+    assert(x3.saveBinary(oss));
+    {
+      std::ofstream ofs(fileName, std::ios::binary);
+      ofs << oss.str();
+    }
+    assert(x5.loadMapped(fileName));
+    oss.str("");
+    assert(x5.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x6.load(iss));
+    for (CSpreadsheet *sheet : {&x4, &x5, &x6})
+    {
+      assert(valueMatch(sheet->getValue(CPos(INT_MAX, 1)), CValue("bottom")));
+      assert(valueMatch(sheet->getValue(CPos(1, INT_MAX)), CValue("right")));
+      assert(valueMatch(sheet->getValue(CPos(INT_MAX, INT_MAX)), CValue("corner")));
+      assert(sheet->page.find(CPos("C0")) == sheet->page.end());
+    }
+    std::remove(fileName);
+
+    std::cout << "Mapped snapshot tests passed." << std::endl;
+}
+
+
+void parallel_load_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+    std::string data;
+
+    for (unsigned row = 0; row < 2000; ++row)
+    {
+      assert(x0.setCell(CPos(row, 1), std::to_string(row)));
+      assert(x0.setCell(CPos(row, 2), "=A" + std::to_string(row) + "*2"));
+      assert(x0.setCell(CPos(row, 3), "text " + std::to_string(row)));
+    }
+    assert(x0.save(oss));
+    data = oss.str();
+
+    // Test 1: Any thread count gives the same sheet as load
+    for (unsigned threads : {1u, 3u, 8u, 10000u, 0u})
+    {
+      CSpreadsheet loaded;
+      iss.clear();
+      iss.str(data);
+      assert(loaded.loadParallel(iss, threads));
+      assert(loaded.page.size() == x0.page.size());
+      for (unsigned row = 0; row < 2000; row += 97)
+        for (unsigned column = 1; column <= 3; ++column)
+          assert(valueMatch(loaded.getValue(CPos(row, column)), x0.getValue(CPos(row, column))));
+    }
+
+    // Test 2: Later record wins even when the duplicates land in different chunks
+    std::string last = "BUNKA5CONTlast\x1f";
+    close_block(last);
+    iss.clear();
+    iss.str(data + last);
+    assert(x1.loadParallel(iss, 4));
+    assert(valueMatch(x1.getValue(CPos("A5")), CValue("last")));
+    assert(valueMatch(x1.getValue(CPos("B5")), CValue()));
+
+    // Test 3: Broken record in any chunk leaves the sheet untouched
+    assert(x2.setCell(CPos("A1"), "5"));
+    std::string first = "BUNKA1CONT1\x1f", broken = "BUNKB1CONT=1+\x1f";
+    close_block(first);
+    close_block(broken);
+    iss.clear();
+    iss.str(first + data + broken);
+    assert(!x2.loadParallel(iss, 4));
+    assert(x2.page.size() == 1);
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue(5.0)));
+    iss.clear();
+    iss.str("");
+    assert(x2.loadParallel(iss, 4));
+
+    std::cout << "Parallel load tests passed." << std::endl;
+}
+
+
+void lazy_parsing_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+
+    // Test 1: Formulas are parsed on first read, results match eager load
+    assert(x0.setCell(CPos("A1"), "10"));
+    assert(x0.setCell(CPos("A2"), "=A1*2"));
+    assert(x0.setCell(CPos("A3"), "=A2+A1"));
+    assert(x0.setCell(CPos("B1"), "=B2"));
+    assert(x0.setCell(CPos("B2"), "=B1"));
+    assert(x0.save(oss));
+    x1.setLazyParsing(true);
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A3")), CValue(30.0)));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue()));
+    assert(x1.page.at(CPos("A2")).getContent() == "=A1*2");
+
+    // Test 2: Broken formula is accepted by lazy load and reads as empty cell
+    x2.setLazyParsing(true);
+    iss.clear();
+    iss.str("BUNKA1CONT=1+\x1f" "BUNKA2CONT=A1\x1f" "BUNKA3CONT=2*3\x1f");
+    assert(x2.loadParallel(iss, 2));
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue()));
+    assert(valueMatch(x2.getValue(CPos("A2")), CValue()));
+    assert(valueMatch(x2.getValue(CPos("A3")), CValue(6.0)));
+
+    // Test 3: Unparsed cells survive save and binary snapshots unchanged
+    oss.str("");
+    assert(x2.saveBinary(oss));
+    CSpreadsheet x3;
+    iss.clear();
+    iss.str(oss.str());
+    assert(x3.loadBinary(iss));
+    assert(x3.page.at(CPos("A1")).getContent() == "=1+");
+    assert(valueMatch(x3.getValue(CPos("A1")), CValue()));
+    assert(valueMatch(x3.getValue(CPos("A3")), CValue(6.0)));
+
+    // Test 4: setCell keeps validating eagerly
+    assert(!x2.setCell(CPos("A4"), "=1+"));
+
+    std::cout << "Lazy parsing tests passed." << std::endl;
+}
+
+
+void persisted_values_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+    std::string data;
+
+    assert(x0.setCell(CPos("A1"), "10"));
+    assert(x0.setCell(CPos("A2"), "=A1*2"));
+    assert(x0.setCell(CPos("A3"), "=A2+1"));
+    assert(x0.setCell(CPos("B1"), "=\"value \"+A1"));
+    assert(x0.setCell(CPos("C1"), "=C2"));
+    assert(x0.setCell(CPos("C2"), "=C1"));
+    assert(x0.setCell(CPos("D1"), "=5"));
+    assert(x0.saveBinary(oss, true));
+    data = oss.str();
+
+    // Test 1: Persisted values load like plain snapshot
+    iss.str(data);
+    assert(x1.loadBinary(iss));
+    assert(valueMatch(x1.getValue(CPos("A3")), CValue(21.0)));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue("value 10")));
+    assert(valueMatch(x1.getValue(CPos("C1")), CValue()));
+
+    // Test 2: Reads are served from the file until an input changes
+    std::string stored = data.substr(0, CSnapshotView::unsealed(data) - 8); // A3 is the last cell, its value ends right before the checksums
+    put_double(stored, 42);
+    CSnapshotView::seal(stored);
+    iss.clear();
+    iss.str(stored);
+    assert(x2.loadBinary(iss));
+    assert(valueMatch(x2.getValue(CPos("A3")), CValue(42.0)));
+    assert(x2.setCell(CPos("E1"), "unrelated"));
+    assert(x2.setCell(CPos("D1"), "=6"));
+    assert(valueMatch(x2.getValue(CPos("A3")), CValue(42.0)));
+    assert(valueMatch(x2.getValue(CPos("D1")), CValue(6.0)));
+
+    // Test 3: Editing input recalculates its transitive dependents
+    assert(x2.setCell(CPos("A1"), "11"));
+    assert(valueMatch(x2.getValue(CPos("A2")), CValue(22.0)));
+    assert(valueMatch(x2.getValue(CPos("A3")), CValue(23.0)));
+    assert(valueMatch(x2.getValue(CPos("B1")), CValue("value 11")));
+
+    // Test 4: Values are ignored when the sheet already holds other cells
+    CSpreadsheet x3;
+    assert(x3.setCell(CPos("Z1"), "1"));
+    iss.clear();
+    iss.str(stored);
+    assert(x3.loadBinary(iss));
+    assert(valueMatch(x3.getValue(CPos("A3")), CValue(21.0)));
+
+    // Test 5: Cells a mapped file adds invalidate values of formulas reading them
+    const char *fileName = "persisted_values_test.bin";
+    CSpreadsheet x4, x5, x6;
+    assert(x4.setCell(CPos("E5"), "=E6"));
+    oss.str("");
+    assert(x4.saveBinary(oss, true));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x5.loadBinary(iss));
+    assert(valueMatch(x5.getValue(CPos("E5")), CValue()));
+    assert(x6.setCell(CPos("E6"), "5"));
+    oss.str("");
+    assert(x6.saveBinary(oss));
+    {
+      std::ofstream ofs(fileName, std::ios::binary);
+      ofs << oss.str();
+    }
+    assert(x5.loadMapped(fileName));
+    assert(valueMatch(x5.getValue(CPos("E5")), CValue(5.0)));
+    std::remove(fileName);
+
+    std::cout << "Persisted values tests passed." << std::endl;
+}
+
+
+void journal_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream base, journal;
+    std::istringstream iss;
+
+    // Test 1: Base snapshot plus journal recovers the sheet
+    assert(x0.setCell(CPos("A1"), "1"));
+    assert(x0.saveBinary(base));
+    x0.attachJournal(&journal);
+    assert(x0.setCell(CPos("A2"), "=$A1*10"));
+    assert(x0.setCell(CPos("B1"), "text with \x1f and \0 inside"s));
+    assert(!x0.setCell(CPos("B2"), "=1+"));
+    std::vector<std::pair<CPos, std::string>> batch = {{CPos("A1"), "2"}, {CPos("A3"), "=$A2+$A1"}};
+    assert(x0.setCells(batch));
+    x0.copyRect(CPos("C2"), CPos("A2"), 1, 2);
+    assert(x0.setCell(CPos("A1"), "3"));
+
+    iss.str(base.str());
+    assert(x1.loadBinary(iss));
+    iss.clear();
+    iss.str(journal.str());
+    assert(x1.replayJournal(iss));
+    for (const char *code : {"A1", "A2", "A3", "B1", "B2", "C2", "C3"})
+      assert(valueMatch(x1.getValue(CPos(code)), x0.getValue(CPos(code))));
+    assert(valueMatch(x1.getValue(CPos("C3")), CValue(33.0)));
+
+    // Test 2: Interrupted last append is ignored, damaged record fails
+    iss.clear();
+    iss.str(journal.str().substr(0, journal.str().size() - 3));
+    assert(x2.replayJournal(iss));
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue(2.0)));
+    std::string damaged = journal.str();
+    damaged[7] ^= 0x5a; // Row of the first record
+    iss.clear();
+    iss.str(damaged);
+    assert(!x2.replayJournal(iss));
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue(2.0)));
+
+    // Test 3: Copies do not write into the journal of the original
+    CSpreadsheet copy = x0;
+    size_t before = journal.str().size();
+    assert(copy.setCell(CPos("D1"), "1"));
+    assert(journal.str().size() == before);
+
+    // Test 4: Compaction folds journal into new base
+    std::ostringstream compacted, fresh;
+    assert(x0.compact(compacted, &fresh));
+    assert(x0.setCell(CPos("D1"), "=A1"));
+    CSpreadsheet x3;
+    iss.clear();
+    iss.str(compacted.str());
+    assert(x3.loadBinary(iss));
+    iss.clear();
+    iss.str(fresh.str());
+    assert(x3.replayJournal(iss));
+    assert(valueMatch(x3.getValue(CPos("D1")), CValue(3.0)));
+    assert(valueMatch(x3.getValue(CPos("C3")), CValue(33.0)));
+
+    // Test 5: Batch is one record, failed journal writes leave the sheet unchanged
+    std::ostringstream batched;
+    CSpreadsheet x4, x5;
+    x4.attachJournal(&batched);
+    std::vector<std::pair<CPos, std::string>> three = {{CPos("A1"), "1"}, {CPos("A2"), "=A1+1"}, {CPos("B1"), "text"}};
+    assert(x4.setCells(three));
+    iss.clear();
+    iss.str(batched.str().substr(0, batched.str().size() - 1));
+    assert(x5.replayJournal(iss));
+    assert(valueMatch(x5.getValue(CPos("A1")), CValue()));
+    iss.clear();
+    iss.str(batched.str());
+    assert(x5.replayJournal(iss));
+    for (const char *code : {"A1", "A2", "B1"})
+      assert(valueMatch(x5.getValue(CPos(code)), x4.getValue(CPos(code))));
+    batched.setstate(std::ios::badbit);
+    std::vector<std::pair<CPos, std::string>> rejected = {{CPos("A1"), "5"}, {CPos("C1"), "6"}};
+    assert(!x4.setCells(rejected));
+    assert(valueMatch(x4.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x4.getValue(CPos("C1")), CValue()));
+    x4.copyRect(CPos("C1"), CPos("A1"), 1, 2);
+    assert(valueMatch(x4.getValue(CPos("C2")), CValue()));
+
+    std::cout << "Journal tests passed." << std::endl;
+}
+
+void block_checksum_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+
+    // Test 1: Both implementations match the CRC32C check value
+    assert(crc32c("123456789") == 0xe3069283u);
+    std::string bytes(1000, '\0');
+    for (size_t i = 0; i < bytes.size(); ++i)
+      bytes[i] = char(i * 31 + 7);
+    for (size_t size : {0, 1, 7, 8, 9, 1000})
+      assert(crc32c(std::string_view(bytes).substr(0, size)) == ~crc32c_table(~0u, reinterpret_cast<const unsigned char *>(bytes.data()), size));
+
+    // Test 2: Text file spanning several blocks detects any damage before applying cells
+    for (unsigned row = 0; row < 5000; ++row)
+    {
+      assert(x0.setCell(CPos(row, 1), "text " + std::to_string(row)));
+      assert(x0.setCell(CPos(row, 2), "=A" + std::to_string(row) + "+1"));
+    }
+    assert(x0.save(oss));
+    std::string text = oss.str();
+    assert(text.size() > 2 * TEXT_BLOCK);
+    assert(x2.setCell(CPos("A1"), "5"));
+    for (size_t i = 0; i < text.size(); i += 4999)
+    {
+      std::string broken = text;
+      broken[i] ^= 0x01;
+      iss.clear();
+      iss.str(broken);
+      assert(!x2.load(iss));
+      iss.clear();
+      iss.str(broken);
+      assert(!x2.loadParallel(iss, 3));
+    }
+    iss.clear();
+    iss.str(text.substr(0, text.size() - 1));
+    assert(!x2.load(iss));
+    iss.clear();
+    iss.str(text.substr(0, TEXT_BLOCK)); // Cut in the middle of the first block
+    assert(!x2.load(iss));
+    assert(x2.page.size() == 1);
+    assert(valueMatch(x2.getValue(CPos("A1")), CValue(5.0)));
+    iss.clear();
+    iss.str(text);
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos(4321, 1)), CValue("text 4321")));
+
+    // Test 3: Files without checksums still load, damaged checksum record does not pass as such file
+    iss.clear();
+    iss.str("BUNKA1CONT1\x1f" "BUNKA2CONT=A1*2\x1f");
+    assert(x2.load(iss));
+    assert(valueMatch(x2.getValue(CPos("A2")), CValue(2.0)));
+    std::string single = "BUNKA1CONT1\x1f";
+    close_block(single);
+    single[single.size() - 12] = 'X';
+    iss.clear();
+    iss.str(single);
+    assert(!x2.load(iss));
+
+    // Test 4: Binary snapshot spanning several blocks
+    std::ostringstream binary;
+    assert(x0.saveBinary(binary));
+    std::string data = binary.str();
+    assert(data.size() > 2 * CSnapshotView::BLOCK_SIZE);
+    iss.clear();
+    iss.str(data);
+    assert(x1.loadBinary(iss));
+    assert(valueMatch(x1.getValue(CPos(4999, 2)), x0.getValue(CPos(4999, 2))));
+    for (size_t i = 0; i < data.size(); i += 3001)
+    {
+      std::string broken = data;
+      broken[i] ^= 0x01;
+      iss.clear();
+      iss.str(broken);
+      assert(!x2.loadBinary(iss));
+    }
+    assert(valueMatch(x2.getValue(CPos("A2")), CValue(2.0)));
+
+    std::cout << "Block checksum tests passed." << std::endl;
+}
+
+void compressed_snapshot_tests() {
+    const char *fileName = "compressed_snapshot_test.bin";
+    CSpreadsheet x0, x1, x2, x3;
+    std::ostringstream plain, compressed;
+    std::istringstream iss;
+
+    // Time series column, column with gaps and negative numbers, mixed column, far away cell
+    for (unsigned row = 0; row < 3000; ++row)
+    {
+      assert(x0.setCell(CPos(row, 1), std::to_string(1700000000 + row * 60)));
+      assert(x0.setCell(CPos(row, 2), number_to_text(20.0 + (row % 50) * 0.25)));
+      if (row % 7 == 0)
+        assert(x0.setCell(CPos(row * 3, 3), number_to_text(-1.0 / (row + 1))));
+    }
+    assert(x0.setCell(CPos("D1"), "label"));
+    assert(x0.setCell(CPos("D2"), "=A1+B1"));
+    assert(x0.setCell(CPos("D3"), "1e3"));
+    assert(x0.setCell(CPos("D4"), "=D2*2"));
+    assert(x0.setCell(CPos(1u << 30, 4), "=D3"));
+    assert(x0.saveBinary(plain));
+    x0.setSnapshotCompression(true);
+    assert(x0.saveBinary(compressed));
+    std::string data = compressed.str();
+
+    // Test 1: Compressed snapshot is much smaller and loads the same sheet
+    assert(data.size() * 3 < plain.str().size());
+    iss.str(data);
+    assert(x1.loadBinary(iss));
+    assert(x1.page.size() == x0.page.size());
+    for (const auto &[pos, cell] : x0.page)
+    {
+      assert(x1.page.at(pos).getContent() == cell.getContent());
+      assert(valueMatch(x1.getValue(pos), x0.getValue(pos)));
+    }
+    assert(valueMatch(x1.getValue(CPos("D4")), CValue(2 * (1700000060.0 + 20.25))));
+
+    // Test 2: Persisted values and mapped loading work on compressed snapshots
+    std::ostringstream withValues;
+    assert(x0.saveBinary(withValues, true));
+    iss.clear();
+    iss.str(withValues.str());
+    assert(x2.loadBinary(iss));
+    assert(valueMatch(x2.getValue(CPos(1u << 30, 4)), CValue(1000.0)));
+    {
+      std::ofstream ofs(fileName, std::ios::binary);
+      ofs << data;
+    }
+    assert(x3.loadMapped(fileName));
+    assert(valueMatch(x3.getValue(CPos(2999, 1)), CValue(1700000000.0 + 2999 * 60)));
+    assert(valueMatch(x3.getValue(CPos(2999, 2)), x0.getValue(CPos(2999, 2))));
+    assert(valueMatch(x3.getValue(CPos(21, 3)), CValue(-1.0 / 8)));
+    assert(valueMatch(x3.getValue(CPos(22, 3)), CValue()));
+    CSpreadsheet copy = x3;
+    std::remove(fileName);
+    assert(valueMatch(copy.getValue(CPos("D4")), x0.getValue(CPos("D4"))));
+
+    // Test 3: Damaged stream with valid checksums is rejected or decodes without crashing
+    size_t size = CSnapshotView::unsealed(data);
+    for (size_t i = size / 2; i < size; i += 3)
+    {
+      std::string broken = data.substr(0, size);
+      broken[i] ^= 0x24;
+      CSnapshotView::seal(broken);
+      CSpreadsheet target;
+      iss.clear();
+      iss.str(broken);
+      if (target.loadBinary(iss))
+        target.getValue(CPos("D4"));
+    }
+
+    std::cout << "Compressed snapshot tests passed." << std::endl;
+}
+
+void csv_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream oss;
+    std::istringstream iss;
+
+    // Test 1: Numbers, text, formulas and quoted fields are imported from the origin
+    assert(x0.setCell(CPos("A3"), "kept"));
+    iss.str("1,2.5,-3e2\r\n"
+            "text,\"quoted, with comma\",\"say \"\"hi\"\"\"\n"
+            ",\"multi\nline\",=A1+B1\n"
+            " 7,12abc,inf\n"
+            "0x10");
+    assert(x0.importCSV(iss, CPos("A1")));
+    assert(valueMatch(x0.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x0.getValue(CPos("B1")), CValue(2.5)));
+    assert(valueMatch(x0.getValue(CPos("C1")), CValue(-300.0)));
+    assert(valueMatch(x0.getValue(CPos("A2")), CValue("text")));
+    assert(valueMatch(x0.getValue(CPos("B2")), CValue("quoted, with comma")));
+    assert(valueMatch(x0.getValue(CPos("C2")), CValue("say \"hi\"")));
+    assert(valueMatch(x0.getValue(CPos("A3")), CValue("kept")));
+    assert(valueMatch(x0.getValue(CPos("B3")), CValue("multi\nline")));
+    assert(valueMatch(x0.getValue(CPos("C3")), CValue(3.5)));
+    assert(valueMatch(x0.getValue(CPos("A4")), CValue(7.0)));  // Same classification as setCell
+    assert(valueMatch(x0.getValue(CPos("B4")), CValue(12.0)));
+    assert(valueMatch(x0.getValue(CPos("C4")), CValue(INFINITY)));
+    assert(valueMatch(x0.getValue(CPos("A5")), CValue(16.0)));
+    assert(x0.page.at(CPos("A4")).getContent() == " 7");
+
+    // Test 2: Broken input leaves the sheet untouched
+    for (const char *broken : {"1,\"unterminated\n2", "1,ab\"c\n", "1,\"a\"b\n", "1,=1+\n", "1e999"})
+    {
+      iss.clear();
+      iss.str(broken);
+      assert(!x0.importCSV(iss, CPos("E1")));
+      assert(valueMatch(x0.getValue(CPos("E1")), CValue()));
+    }
+
+    // Test 3: Export writes values of the whole rectangle, quoting where needed
+    assert(x0.exportCSV(oss, CPos("A1"), 4, 6));
+    assert(oss.str() == "1,2.5,-300,\n"
+                        "text,\"quoted, with comma\",\"say \"\"hi\"\"\",\n"
+                        "kept,\"multi\nline\",3.5,\n"
+                        "7,12,inf,\n"
+                        "16,,,\n"
+                        ",,,\n");
+    oss.str("");
+    assert(x0.exportCSV(oss, CPos("B2"), 1, 1));
+    assert(oss.str() == "\"quoted, with comma\"\n");
+
+    // Test 4: Exported values import back to the same values
+    for (unsigned row = 0; row < 300; ++row)
+      for (unsigned column = 1; column <= 4; ++column)
+        if ((row + column) % 3 != 0)
+          assert(x1.setCell(CPos(row, column), column == 4 ? "=A" + std::to_string(row) + "/7" : (column == 2 ? "text, " : "") + std::to_string(row * column)));
+    oss.str("");
+    assert(x1.exportCSV(oss, CPos(0, 1), 4, 300));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x2.importCSV(iss, CPos(0, 1)));
+    for (unsigned row = 0; row < 300; ++row)
+      for (unsigned column = 1; column <= 4; ++column)
+        assert(valueMatch(x2.getValue(CPos(row, column)), x1.getValue(CPos(row, column))));
+
+    // Test 5: Fields past the last row or column reject the whole import, empty ones there are fine
+    CSpreadsheet x3;
+    iss.clear();
+    iss.str("1,2\n3,\n,\n");
+    assert(x3.importCSV(iss, CPos(INT_MAX - 1, INT_MAX - 1)));
+    assert(valueMatch(x3.getValue(CPos(INT_MAX, INT_MAX - 1)), CValue(3.0)));
+    iss.clear();
+    iss.str("5,6,7\n");
+    assert(!x3.importCSV(iss, CPos(0, INT_MAX - 1)));
+    iss.clear();
+    iss.str("5\n6\n7\n");
+    assert(!x3.importCSV(iss, CPos(INT_MAX - 1, 1)));
+    assert(valueMatch(x3.getValue(CPos(0, INT_MAX - 1)), CValue()));
+    assert(valueMatch(x3.getValue(CPos(INT_MAX - 1, 1)), CValue()));
+
+    std::cout << "CSV tests passed." << std::endl;
+}
+
+void paging_tests() {
+    const char *spillName = "paging_test.spill", *spillCopyName = "paging_test_copy.spill", *baseName = "paging_test_base.bin";
+    const size_t budget = 400 * CTilePager::CELL_BYTES;
+    CSpreadsheet x0, reference;
+    std::ostringstream saved, expected;
+
+    // Test 1: Resident cells stay within the budget while the sheet grows
+    assert(x0.enablePaging(spillName, budget));
+    for (unsigned row = 0; row < 5000; ++row)
+      for (CSpreadsheet *sheet : {&x0, &reference})
+      {
+        assert(sheet->setCell(CPos(row, 1), std::to_string(row)));
+        assert(sheet->setCell(CPos(row, 2), row < CTilePager::TILE_ROWS ? "=A" + std::to_string(row) : "=B" + std::to_string(row - CTilePager::TILE_ROWS) + "+A" + std::to_string(row)));
+        assert(sheet->setCell(CPos(row, 3), "text " + std::to_string(row)));
+      }
+    assert(x0.page.size() * CTilePager::CELL_BYTES <= budget);
+
+    // Test 2: Reads page tiles back in, references crossing tiles included
+    for (unsigned row : {4999u, 0u, 1234u, 64u, 63u, 2500u})
+      for (unsigned column = 1; column <= 3; ++column)
+        assert(valueMatch(x0.getValue(CPos(row, column)), reference.getValue(CPos(row, column))));
+    double chain = 0; // Every formula reads the row one tile above, so evaluation crosses tiles without deep recursion
+    for (int row = 4999; row >= 0; row -= CTilePager::TILE_ROWS)
+      chain += row;
+    assert(valueMatch(x0.getValue(CPos(4999, 2)), CValue(chain)));
+    assert(x0.page.size() * CTilePager::CELL_BYTES <= budget);
+
+    // Test 3: Changed tiles are written back before they leave page
+    for (CSpreadsheet *sheet : {&x0, &reference})
+    {
+      assert(sheet->setCell(CPos(10, 1), "1000"));
+      sheet->copyRect(CPos(4000, 3), CPos(20, 3), 1, 3);
+    }
+    for (unsigned row = 3000; row < 3500; ++row)
+      x0.getValue(CPos(row, 3));
+    assert(valueMatch(x0.getValue(CPos(10, 1)), CValue(1000.0)));
+    assert(valueMatch(x0.getValue(CPos(4999, 2)), reference.getValue(CPos(4999, 2))));
+    assert(valueMatch(x0.getValue(CPos(4001, 3)), CValue("text 21")));
+
+    // Test 4: Bulk reads and saves see spilled tiles
+    std::vector<CValue> values = x0.getValues(CPos(0, 1), 3, 5000), reference_values = reference.getValues(CPos(0, 1), 3, 5000);
+    for (size_t i = 0; i < values.size(); ++i)
+      assert(valueMatch(values[i], reference_values[i]));
+    assert(x0.save(saved));
+    assert(reference.save(expected));
+    assert(saved.str() == expected.str());
+
+    // Test 5: Spilled edits and cleared cells hide the mapped snapshot
+    std::ostringstream base;
+    CSpreadsheet x1, x2;
+    assert(reference.saveBinary(base));
+    {
+      std::ofstream ofs(baseName, std::ios::binary);
+      ofs << base.str();
+    }
+    assert(x1.loadMapped(baseName));
+    assert(x1.enablePaging(spillCopyName, budget));
+    assert(x1.setCell(CPos(100, 3), "changed"));
+    x1.copyRect(CPos(101, 3), CPos(100, 7));
+    for (unsigned row = 1000; row < 2000; ++row)
+      x1.getValue(CPos(row, 2));
+    assert(x1.page.size() * CTilePager::CELL_BYTES <= budget);
+    assert(valueMatch(x1.getValue(CPos(100, 3)), CValue("changed")));
+    assert(valueMatch(x1.getValue(CPos(101, 3)), CValue()));
+    assert(valueMatch(x1.getValue(CPos(102, 3)), CValue("text 102")));
+    assert(valueMatch(x1.getValue(CPos(4999, 2)), reference.getValue(CPos(4999, 2))));
+
+    // Test 6: Copies keep their own tiles
+    x2 = x1;
+    assert(x2.setCell(CPos(100, 3), "copy"));
+    for (unsigned row = 3000; row < 4000; ++row)
+      x2.getValue(CPos(row, 1));
+    assert(valueMatch(x2.getValue(CPos(100, 3)), CValue("copy")));
+    assert(valueMatch(x1.getValue(CPos(100, 3)), CValue("changed")));
+
+    // Test 7: Spilled cells keep persisted values of a loaded snapshot from being trusted
+    std::ostringstream withValues;
+    std::istringstream iss;
+    CSpreadsheet x3, x4;
+    assert(x3.setCell(CPos("E5"), "=E6"));
+    assert(x3.saveBinary(withValues, true));
+    assert(x4.enablePaging(spillName, CTilePager::CELL_BYTES + CTilePager::TILE_BYTES));
+    assert(x4.setCell(CPos("E6"), "5"));
+    x4.getValue(CPos(1000, 1));
+    assert(x4.page.empty());
+    iss.str(withValues.str());
+    assert(x4.loadBinary(iss));
+    assert(valueMatch(x4.getValue(CPos("E5")), CValue(5.0)));
+
+    // Test 8: Damaged spill copy fails the call instead of reading as empty tile
+    const char *damagedName = "paging_test_damaged.spill";
+    CSpreadsheet x5;
+    assert(x5.enablePaging(damagedName, CTilePager::CELL_BYTES + CTilePager::TILE_BYTES));
+    assert(x5.setCell(CPos("E6"), "5"));
+    x5.getValue(CPos(1000, 1));
+    assert(x5.page.empty());
+    auto flipFirstByte = [&]
+    {
+      std::fstream spill(damagedName, std::ios::in | std::ios::out | std::ios::binary);
+      char first = char(spill.get() ^ 0x5a);
+      spill.seekp(0);
+      spill.put(first);
+    };
+    flipFirstByte();
+    std::vector<std::pair<CPos, std::string>> nearby = {{CPos("E7"), "1"}};
+    assert(!x5.setCell(CPos("E7"), "1"));
+    assert(!x5.setCells(nearby));
+    assert(!x5.fillDown(CPos("A1"), 1, 1, 1));
+    assert(x5.setCell(CPos(1000, 1), "copied"));
+    x5.copyRect(CPos("F6"), CPos(1000, 1));
+    bool threw = false;
+    try
+    {
+      x5.getValue(CPos("E6"));
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+    flipFirstByte();
+    assert(valueMatch(x5.getValue(CPos("E6")), CValue(5.0)));
+    assert(valueMatch(x5.getValue(CPos("A2")), CValue()));
+    assert(valueMatch(x5.getValue(CPos("F6")), CValue()));
+    assert(x5.setCell(CPos("E7"), "=E6+1"));
+    assert(valueMatch(x5.getValue(CPos("E7")), CValue(6.0)));
+
+    std::remove(damagedName);
+    std::remove(spillName);
+    std::remove(spillCopyName);
+    std::remove(baseName);
+    std::cout << "Paging tests passed." << std::endl;
+}
+
+void classification_tests() {
+    CSpreadsheet x0;
+    std::istringstream iss;
+
+    // Test 1: Numbers are recognized exactly where std::stod recognizes them
+    for (const char *text : {"1", "-2.5", "+3", " \t42", "1e3", "1E-3", ".5", "-.5", "5.", "12abc", "1e", "1e+", "0x1A", "-0X1p3", "0x", "0xg",
+                             "inf", "-Infinity", "nan", "NAN(123)", "infinite", "1e999", "-1e999", "1e-400", "1e-310", "", " ", "abc", ".", "-",
+                             "+-1", "-+1", "++1", "--1", "+", "e5", "x1", "1_000", "\n7", "0.1.2", "00012", "-0"})
+    {
+      double number = 0, expected = 0;
+      std::errc ec = parse_number(text, number), expectedEc = std::errc();
+      try
+      {
+        expected = std::stod(text);
+      }
+      catch (const std::invalid_argument &)
+      {
+        expectedEc = std::errc::invalid_argument;
+      }
+      catch (const std::out_of_range &)
+      {
+        expectedEc = std::errc::result_out_of_range;
+      }
+      assert(ec == expectedEc);
+      assert(ec != std::errc() || std::memcmp(&number, &expected, sizeof(number)) == 0 || (std::isnan(number) && std::isnan(expected)));
+    }
+
+    // Test 2: Cell codes are accepted exactly where the CPos constructor accepts them
+    for (const char *code : {"A1", "a1", "$A$1", "A$1", "$A1", "ZZ123", "A 1", "A+1", "A+-1", "A", "1", "1A", "A1B", "$$A1", "A$$1", "A1.5", "",
+                             "A99999999999", "AAAAAAAAAAAAA1", "A1 ", "Ab12"})
+    {
+      std::optional<CPos> parsed = CPos::fromCode(code);
+      try
+      {
+        CPos pos(code);
+        assert(parsed && parsed->row == pos.row && parsed->column == pos.column && parsed->relative_row == pos.relative_row &&
+               parsed->relative_column == pos.relative_column && parsed->getCode() == pos.getCode());
+      }
+      catch (const std::exception &)
+      {
+        assert(!parsed);
+      }
+    }
 
-  assert ( x0 . setCell ( CPos ( "A1" ), "10" ) );
-  assert ( x0 . setCell ( CPos ( "A2" ), "0" ) );
-  assert ( x0 . setCell ( CPos ( "A3" ), "=A1/A2" ) );
+    // Test 3: Rejected contents and positions report failure and change nothing
+    assert(!x0.setCell(CPos("A1"), "1e999"));
+    assert(!x0.setCell(CPos("A1"), "=1+"));
+    assert(x0.setCell(CPos("A2"), "text"));
+    assert(x0.setCell(CPos("A3"), "12abc"));
+    assert(valueMatch(x0.getValue(CPos("A1")), CValue()));
+    assert(valueMatch(x0.getValue(CPos("A2")), CValue("text")));
+    assert(valueMatch(x0.getValue(CPos("A3")), CValue(12.0)));
+    for (const char *broken : {"BUNKA1CONT1e999\x1f", "BUNKA 1xCONT1\x1f", "BUNK$CONT1\x1f"})
+    {
+      iss.clear();
+      iss.str(broken);
+      assert(!x0.load(iss));
+    }
+    assert(valueMatch(x0.getValue(CPos("A2")), CValue("text")));
 
-    assert ( valueMatch ( x0 . getValue ( CPos ( "A3" ) ), CValue () ) );
-  assert ( x0 . setCell ( CPos ( "A2" ), "Hello\n" ) );
-  assert ( x0 . setCell ( CPos ( "A3" ), "its me" ) );
-  assert ( x0 . setCell ( CPos ( "A1" ), "=A2+A3" ) );
-  assert ( valueMatch ( x0 . getValue ( CPos ( "A1" ) ), CValue ("Hello\nits me") ) );
-  assert ( x0 . setCell ( CPos ( "A3" ), "3" ) );
-  assert ( x0 . setCell ( CPos ( "A1" ), "=A2+A3" ) );
+    std::cout << "Classification tests passed." << std::endl;
+}
 
+void dependency_tests() {
+    CSpreadsheet x0, x1;
+    std::ostringstream oss;
+    std::istringstream iss;
 
-  assert ( x1 . setCell ( CPos ( "A0" ), "22" ) );
-  assert ( x1 . setCell ( CPos ( "A1" ), "99" ) );
-  x1 . copyRect ( CPos ( "A0" ), CPos ( "A1" ), 1, 1 );
-  assert ( valueMatch ( x1 . getValue ( CPos ( "A0" ) ), x1 . getValue ( CPos ( "A1" ) ) ) );
+    // Test 1: Only references seen by the parser are dependencies, sorted and without duplicates
+    CCell cell("=\"A1 Z9\" + b2 + $B$2 + C1*A10 - ABS(B$2)");
+    std::vector<uint64_t> expected = {pack_position(1, 3), pack_position(2, 2), pack_position(10, 1)};
+    assert(cell.getReferences() == expected);
+    assert(CCell("=\"A1\"").getReferences().empty());
+    assert(CCell("12").getReferences().empty());
+
+    // Test 2: Text that looks like a reference does not make a cycle
+    assert(x0.setCell(CPos("A1"), "=\"B1\""));
+    assert(x0.setCell(CPos("B1"), "=A1"));
+    assert(x0.setCell(CPos("C1"), "=C2+1"));
+    assert(x0.setCell(CPos("C2"), "=$C$1"));
+    assert(valueMatch(x0.getValue(CPos("B1")), CValue("B1")));
+    assert(valueMatch(x0.getValue(CPos("C1")), CValue()));
+
+    // Test 3: Formulas restored from a snapshot carry the same dependencies
+    assert(x0.saveBinary(oss));
+    iss.str(oss.str());
+    assert(x1.loadBinary(iss));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue("B1")));
+    assert(valueMatch(x1.getValue(CPos("C2")), CValue()));
+
+    std::cout << "Dependency tests passed." << std::endl;
+}
 
-};
+void parse_cache_tests() {
+    CSpreadsheet x0;
+    CParseCache cache;
+    std::string key1, key2;
+
+    // Test 1: Keys are equal exactly when formulas differ only by the anchor
+    assert(formula_key("=A1+1", 1, 2, key1) && formula_key("=a2+1", 2, 2, key2) && key1 == key2);
+    assert(formula_key("=A1+1", 1, 2, key1) && formula_key("=A1+1", 2, 2, key2) && key1 != key2);
+    assert(formula_key("=$A$1", 1, 2, key1) && formula_key("=$A$1", 7, 9, key2) && key1 == key2);
+    assert(formula_key("=$A1", 1, 2, key1) && formula_key("=$A1", 1, 3, key2) && key1 == key2);
+    assert(formula_key("=\"A1\"&1e5+0x1A+SUM(B1)", 5, 5, key1) && key1.find("\"A1\"&1e5+0x1A+SUM(") == 1);
+    assert(!formula_key("=\x01" "c0r0\x02", 1, 1, key1) && !formula_key("=A99999999999", 1, 1, key1));
+
+    // Test 2: Repeated formula is compiled once and relocated per cell
+    CCell cell;
+    for (unsigned row = 1; row <= 100; ++row)
+      assert(cache.parse("=A" + std::to_string(row) + "*2+$C$1", CPos(row, 2), cell) == std::errc());
+    assert(cache.size() == 1);
+    std::vector<uint64_t> expected = {pack_position(1, 3), pack_position(100, 1)};
+    assert(cell.getReferences() == expected);
+    assert(cache.parse("=A1+", CPos(1, 2), cell) == std::errc::invalid_argument && cache.size() == 1);
+    assert(cache.parse("text", CPos(1, 2), cell) == std::errc() && cell.get_type() == CCell::TEXT);
+
+    // Test 3: Cache stays bounded, least recently used formula goes first
+    for (size_t i = 0; i < CParseCache::CAPACITY + 10; ++i)
+      assert(cache.parse("=$A$1+" + std::to_string(i), CPos(1, 2), cell) == std::errc());
+    assert(cache.size() == CParseCache::CAPACITY);
+
+    // Test 4: Sheet values and contents of cached formulas
+    assert(x0.setCell(CPos("C1"), "100"));
+    for (unsigned row = 1; row <= 50; ++row)
+    {
+      assert(x0.setCell(CPos(row, 1), std::to_string(row)));
+      assert(x0.setCell(CPos(row, 2), "=A" + std::to_string(row) + "*2+$C$1"));
+    }
+    assert(valueMatch(x0.getValue(CPos("B1")), CValue(102.0)));
+    assert(valueMatch(x0.getValue(CPos("B50")), CValue(200.0)));
+    assert(x0.page.at(CPos("B50")).getContent() == "=A50*2+$C$1");
+    assert(x0.setCell(CPos("D1"), "=D2"));
+    assert(x0.setCell(CPos("D2"), "=D3"));
+    assert(x0.setCell(CPos("D3"), "=D1"));
+    assert(valueMatch(x0.getValue(CPos("D1")), CValue()));
+
+    std::cout << "Parse cache tests passed." << std::endl;
+}
 
-void save_load_tests(){
-  CSpreadsheet x0, x1;
-  std::ostringstream oss;
-  std::istringstream iss;
-  std::string data;
+void relocation_tests() {
+    CSpreadsheet x0, x1;
+    std::ostringstream oss;
+    std::istringstream iss;
 
-  // Test 1: Save and Load a simple numeric value
-  x0.setCell(CPos("A1"), "123.456");
-  assert(x0.save(oss));
-  data = oss.str();
-  iss.str(data);
-  assert(x1.load(iss));
-  assert(valueMatch(x1.getValue(CPos("A1")), CValue(123.456)));
+    assert(x0.setCell(CPos("A1"), "1"));
+    assert(x0.setCell(CPos("A2"), "2"));
+    assert(x0.setCell(CPos("A3"), "3"));
+    assert(x0.setCell(CPos("D1"), "x"));
+    assert(x0.setCell(CPos("D2"), "y"));
+    assert(x0.setCell(CPos("B1"), "=A1*10 + $A$1+A$1*0"));
+    assert(x0.setCell(CPos("C1"), "=\"D1:\" + D1"));
+
+    // Test 1: Relative parts move, absolute parts and string literals stay
+    x0.copyRect(CPos("B2"), CPos("B1"), 2, 1);
+    assert(valueMatch(x0.getValue(CPos("B2")), CValue(21.0)));
+    assert(valueMatch(x0.getValue(CPos("C2")), CValue("D1:y")));
+    assert(x0.page.at(CPos("B2")).getContent() == "=A2*10 + $A$1+A$1*0");
+    assert(x0.page.at(CPos("C2")).getContent() == "=\"D1:\" + D2");
+
+    // Test 2: Copy of a copy
+    x0.copyRect(CPos("B3"), CPos("B2"));
+    assert(valueMatch(x0.getValue(CPos("B3")), CValue(31.0)));
+    assert(x0.page.at(CPos("B3")).getContent() == "=A3*10 + $A$1+A$1*0");
+
+    // Test 3: Copied formulas save and load as text
+    assert(x0.save(oss));
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("B3")), CValue(31.0)));
+    assert(valueMatch(x1.getValue(CPos("C2")), CValue("D1:y")));
+
+    // Test 4: Reference moved outside of the sheet clears the target
+    x0.copyRect(CPos("A1"), CPos("B1"));
+    assert(valueMatch(x0.getValue(CPos("A1")), CValue()));
+    assert(x0.page.at(CPos("A1")).get_type() == CCell::EMPTY);
+
+    // Test 5: Formula that does not compile moves as text
+    CSpreadsheet x2;
+    x2.setLazyParsing(true);
+    iss.clear();
+    iss.str("BUNKB1CONT=A1+\x1f");
+    assert(x2.load(iss));
+    x2.copyRect(CPos("B5"), CPos("B1"));
+    assert(x2.page.at(CPos("B5")).getContent() == "=A5+");
+    assert(valueMatch(x2.getValue(CPos("B5")), CValue()));
 
-  // Clear stream states and contents for the next test
-  oss.str("");
-  oss.clear();
-  iss.clear();
+    std::cout << "Relocation tests passed." << std::endl;
+}
 
-  // Test 2: Save and Load a string value
-  x0.setCell(CPos("B1"), "\"Hello,\t world!\"");
-  assert(x0.save(oss));
-  data = oss.str();
-  iss.str(data);
-  assert(x1.load(iss));
-  assert(valueMatch(x1.getValue(CPos("B1")), CValue("\"Hello,\t world!\"")));
+void bulk_copy_tests() {
+    auto fill = [](CSpreadsheet &sheet)
+    {
+      for (int row = 1; row <= 6; ++row)
+      {
+        assert(sheet.setCell(CPos(row, 1), std::to_string(row)));
+        if (row % 2)
+          assert(sheet.setCell(CPos(row, 2), "=A" + std::to_string(row) + "*10"));
+      }
+    };
 
-  oss.str("");
-  oss.clear();
-  iss.clear();
+    // Test 1: Overlapping copy downwards reads the source as it was
+    CSpreadsheet x0, x1;
+    fill(x0);
+    x0.copyRect(CPos("A3"), CPos("A1"), 2, 6);
+    for (int row = 3; row <= 8; ++row)
+    {
+      assert(valueMatch(x0.getValue(CPos(row, 1)), CValue(double(row - 2))));
+      if (row % 2)
+        assert(valueMatch(x0.getValue(CPos(row, 2)), CValue(double(row - 2) * 10)));
+      else
+        assert(valueMatch(x0.getValue(CPos(row, 2)), CValue()));
+    }
+    assert(valueMatch(x0.getValue(CPos("B2")), CValue()));
+
+    // Test 2: Overlapping copy upwards
+    fill(x1);
+    x1.copyRect(CPos("B1"), CPos("B2"), 1, 5);
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("B2")), CValue(20.0)));
+    assert(valueMatch(x1.getValue(CPos("B4")), CValue(40.0)));
+    assert(valueMatch(x1.getValue(CPos("B6")), CValue()));
+    assert(x1.page.at(CPos("B4")).getContent() == "=A4*10");
+
+    // Test 3: Source in mapped snapshot, target partly in page
+    CSpreadsheet x2;
+    fill(x2);
+    std::string fileName = "/tmp/spreadsheet_bulk_copy.bin";
+    {
+      std::ofstream file(fileName, std::ios::binary);
+      assert(x2.saveBinary(file));
+    }
+    CSpreadsheet x3;
+    assert(x3.loadMapped(fileName));
+    assert(x3.setCell(CPos("D2"), "stale"));
+    x3.copyRect(CPos("C1"), CPos("A1"), 2, 6);
+    assert(valueMatch(x3.getValue(CPos("C4")), CValue(4.0)));
+    assert(valueMatch(x3.getValue(CPos("D5")), CValue(50.0)));
+    assert(valueMatch(x3.getValue(CPos("D2")), CValue()));
+    std::remove(fileName.c_str());
+
+    std::cout << "Bulk copy tests passed." << std::endl;
+}
 
-  // Test 3: Save and Load a formula (as a string for simplicity)
-  x0.setCell(CPos("C1"), "=\"SUM(A1,B1)\"");
-  assert(x0.save(oss));
-  data = oss.str();
-  iss.str(data);
-  assert(x1.load(iss));
-  assert(valueMatch(x1.getValue(CPos("C1")), CValue("SUM(A1,B1)")));
+void fill_tests() {
+    CSpreadsheet x0, x1, x2;
+    std::ostringstream journal;
+    std::istringstream iss;
 
-  oss.str("");
-  oss.clear();
-  iss.clear();
+    // Test 1: Template row filled down, relative references follow, numbers of a series grow
+    x0.attachJournal(&journal);
+    assert(x0.setCell(CPos("A1"), "1"));
+    assert(x0.setCell(CPos("B1"), "=A1*2+$D$1"));
+    assert(x0.setCell(CPos("C1"), "row"));
+    assert(x0.setCell(CPos("D1"), "100"));
+    assert(x0.setCell(CPos("C5"), "overwritten"));
+    assert(x0.fillSeries(CPos("A1"), 3, 1, 999, 1.5));
+    assert(valueMatch(x0.getValue(CPos("A1000")), CValue(1.0 + 999 * 1.5)));
+    assert(valueMatch(x0.getValue(CPos("B1000")), CValue((1.0 + 999 * 1.5) * 2 + 100)));
+    assert(valueMatch(x0.getValue(CPos("C5")), CValue("row")));
+    assert(valueMatch(x0.getValue(CPos("A1001")), CValue()));
+    assert(x0.page.at(CPos("B7")).getContent() == "=A7*2+$D$1");
+    assert(x0.page.at(CPos("A3")).getContent() == "4");
+
+    // Test 2: Block filled right, empty cells of the block clear their targets
+    assert(x0.setCell(CPos("E2"), "=D2"));
+    assert(x0.setCell(CPos("G2"), "old"));
+    assert(x0.fillRight(CPos("E1"), 2, 2, 3));
+    assert(valueMatch(x0.getValue(CPos("G2")), CValue()));
+    assert(x0.page.at(CPos("I2")).getContent() == "=H2");
+    assert(x0.page.at(CPos("K2")).getContent() == "=J2");
+    assert(!x0.fillDown(CPos("A1"), 1, 1, 0));
+    assert(!x0.fillDown(CPos(INT_MAX - 5, 1), 1, 2, 3));
+    assert(x0.setCell(CPos(INT_MAX, 2), "bottom"));
+    assert(x0.fillDown(CPos(INT_MAX - 7, 2), 1, 2, 3)); // Empty block clears the last row too
+    assert(valueMatch(x0.getValue(CPos(INT_MAX, 2)), CValue()));
+
+    // Test 3: Fills are journaled
+    iss.str(journal.str());
+    assert(x1.replayJournal(iss));
+    for (const char *code : {"A500", "B999", "C77", "G2", "I2", "K2"})
+      assert(valueMatch(x1.getValue(CPos(code)), x0.getValue(CPos(code))));
+
+    // Test 4: Fill larger than the paging budget
+    const char *spillName = "fill_test.spill";
+    assert(x2.enablePaging(spillName, 300 * CTilePager::CELL_BYTES));
+    assert(x2.setCell(CPos("A0"), "0"));
+    assert(x2.setCell(CPos("B0"), "=A0+1"));
+    assert(x2.fillSeries(CPos("A0"), 2, 1, 4999, 2));
+    assert(x2.page.size() * CTilePager::CELL_BYTES <= 300 * CTilePager::CELL_BYTES);
+    assert(valueMatch(x2.getValue(CPos("B4999")), CValue(9999.0)));
+    assert(valueMatch(x2.getValue(CPos("A64")), CValue(128.0)));
+    std::remove(spillName);
+
+    std::cout << "Fill tests passed." << std::endl;
+}
 
-  // Test 4: Save and Load with special characters
-  x0.setCell(CPos("D1"), "\"New\\nLine and \\\"escaped\\\" quotes\"");
-  assert(x0.save(oss));
-  data = oss.str();
-  iss.str(data);
-  assert(x1.load(iss));
-  assert(valueMatch(x1.getValue(CPos("D1")), CValue("\"New\\nLine and \\\"escaped\\\" quotes\"")));
+void shift_tests() {
+    CSpreadsheet x0, x1, x2, x3;
+    std::ostringstream journal, oss;
+    std::istringstream iss;
 
-  oss.str("");
-  oss.clear();
-  iss.clear();
+    // Test 1: Inserted rows move cells below them, relative and absolute references follow their cells
+    x0.attachJournal(&journal);
+    assert(x0.setCell(CPos("A1"), "1"));
+    assert(x0.setCell(CPos("A2"), "2"));
+    assert(x0.setCell(CPos("A3"), "=A1+A2"));
+    assert(x0.setCell(CPos("B5"), "=$A$2*10+A$3"));
+    assert(x0.setCell(CPos("C1"), "=A3+\"A2\""));
+    assert(x0.insertRows(2, 3));
+    assert(valueMatch(x0.getValue(CPos("A5")), CValue(2.0)));
+    assert(valueMatch(x0.getValue(CPos("A2")), CValue()));
+    assert(x0.page.at(CPos("A6")).getContent() == "=A1+A5");
+    assert(x0.page.at(CPos("B8")).getContent() == "=$A$5*10+A$6");
+    assert(x0.page.at(CPos("C1")).getContent() == "=A6+\"A2\"");
+    assert(valueMatch(x0.getValue(CPos("B8")), CValue(23.0)));
+    assert(x0.page.find(CPos("B5")) == x0.page.end());
+
+    // Test 2: References into deleted rows become #REF!, cells below move up
+    assert(x0.deleteRows(1));
+    assert(x0.page.at(CPos("A5")).getContent() == "=#REF!+A4");
+    assert(valueMatch(x0.getValue(CPos("A5")), CValue()));
+    assert(x0.page.at(CPos("B7")).getContent() == "=$A$4*10+A$5");
+    assert(valueMatch(x0.getValue(CPos("B7")), CValue()));
+    assert(x0.setCell(CPos("A1"), "5"));
+    assert(x0.page.at(CPos("A5")).getContent() == "=#REF!+A4");
+
+    // Test 3: Columns, and copies whose references have not been rewritten yet
+    assert(x0.setCell(CPos("E1"), "=A4+C1"));
+    x0.copyRect(CPos("F2"), CPos("E1"));
+    assert(x0.insertColumns(2, 2));
+    assert(x0.page.at(CPos("G1")).getContent() == "=A4+E1");
+    assert(x0.page.at(CPos("H2")).getContent() == "=D5+F2");
+    assert(x0.deleteColumns(1));
+    assert(x0.page.at(CPos("F1")).getContent() == "=#REF!+D1");
+    assert(x0.page.at(CPos("G2")).getContent() == "=C5+E2");
+    assert(valueMatch(x0.getValue(CPos("D8")), CValue()));
+    assert(!x0.deleteColumns(0));
+    assert(!x0.insertRows(1, 0));
+
+    // Test 4: Cells are not pushed off the sheet, references to pushed cells become #REF!
+    assert(x1.setCell(CPos(INT_MAX, 1), "7"));
+    assert(x1.setCell(CPos("A1"), "=A2147483646"));
+    assert(!x1.insertRows(5));
+    assert(valueMatch(x1.getValue(CPos(INT_MAX, 1)), CValue(7.0)));
+    assert(x1.setCell(CPos(INT_MAX, 1), ""));
+    assert(x1.deleteRows(INT_MAX));
+    assert(x1.insertRows(5, 5));
+    assert(x1.page.at(CPos("A1")).getContent() == "=#REF!");
+
+    // Test 5: Shifts are journaled
+    iss.str(journal.str());
+    assert(x2.replayJournal(iss));
+    for (const char *code : {"C7", "F1", "G2"})
+      assert(x2.page.at(CPos(code)).getContent() == x0.page.at(CPos(code)).getContent());
+
+    // Test 6: Lazily parsed and paged sheets
+    const char *spillName = "shift_test.spill";
+    assert(x3.enablePaging(spillName, 300 * CTilePager::CELL_BYTES));
+    x3.setLazyParsing(true);
+    CSpreadsheet source;
+    for (unsigned int row = 0; row < 2000; ++row)
+    {
+      assert(source.setCell(CPos(row, 1), std::to_string(row)));
+      assert(source.setCell(CPos(row, 2), "=A" + std::to_string(row) + "*2+$A$0"));
+    }
+    assert(source.save(oss));
+    iss.str(oss.str());
+    iss.clear();
+    assert(x3.load(iss));
+    assert(x3.insertRows(10, 100));
+    assert(x3.page.size() * CTilePager::CELL_BYTES <= 300 * CTilePager::CELL_BYTES);
+    assert(valueMatch(x3.getValue(CPos("B2099")), CValue(3998.0)));
+    assert(valueMatch(x3.getValue(CPos("B5")), CValue(10.0)));
+    assert(valueMatch(x3.getValue(CPos("B50")), CValue()));
+    assert(x3.deleteRows(0));
+    assert(valueMatch(x3.getValue(CPos("B2098")), CValue()));
+    assert(x3.setCell(CPos("A0"), "1"));
+    assert(valueMatch(x3.getValue(CPos("B2098")), CValue()));
+    std::remove(spillName);
+
+    // Test 7: Broken references read as empty cells, parse again and survive saves
+    CSpreadsheet x4, x5, x6;
+    assert(x4.setCell(CPos("A1"), "4"));
+    assert(x4.setCell(CPos("A2"), "=A1*2"));
+    assert(x4.setCell(CPos("B3"), "=A2=#REF!"));
+    assert(x4.setCell(CPos("B4"), "=#REF!+\"#REF!\""));
+    assert(valueMatch(x4.getValue(CPos("B3")), CValue()));
+    assert(x4.deleteRows(1));
+    assert(x4.page.at(CPos("A1")).getContent() == "=#REF!*2");
+    x4.copyRect(CPos("C2"), CPos("A1"));
+    assert(x4.page.at(CPos("C2")).getContent() == "=#REF!*2");
+    oss.str("");
+    assert(x4.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x5.load(iss));
+    oss.str("");
+    assert(x4.saveBinary(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x6.loadBinary(iss));
+    for (CSpreadsheet *sheet : {&x5, &x6})
+    {
+      for (const char *code : {"A1", "B2", "B3", "C2"})
+        assert(sheet->page.at(CPos(code)).getContent() == x4.page.at(CPos(code)).getContent());
+      assert(valueMatch(sheet->getValue(CPos("A1")), CValue()));
+      assert(sheet->setCell(CPos("D1"), sheet->page.at(CPos("A1")).getContent()));
+    }
 
-  // Test 5: Save and Load multiple cells
-  x0.setCell(CPos("A2"), "789.1011");
-  x0.setCell(CPos("B2"), "\"Another\\ \n \t \' \" \\\\ \a \b test\"");
-  x0.setCell(CPos("C2"), "=\"Another\\ \n \t \'  hello \\\\ \a \b test\"");
+    std::cout << "Shift tests passed." << std::endl;
+}
 
-  assert(x0.save(oss));
-  data = oss.str();
-  iss.str(data);
-  assert(x1.load(iss));
-  assert(valueMatch(x1.getValue(CPos("A2")), CValue(789.1011)));
-  assert(valueMatch(x1.getValue(CPos("B2")), CValue("\"Another\\ \n \t \' \" \\\\ \a \b test\"")));
+void interning_tests() {
+    CSpreadsheet x0, x1;
+    std::ostringstream oss;
+    std::istringstream iss;
 
-  assert(valueMatch(x1.getValue(CPos("C2")), CValue("Another\\ \n \t \'  hello \\\\ \a \b test")));
+    // Test 1: Equal texts share one string, formulas read and compare them without copies
+    assert(x0.setCell(CPos("A1"), "a text longer than the short string buffer"));
+    assert(x0.setCell(CPos("A2"), "a text longer than the short string buffer"));
+    assert(x0.setCell(CPos("A3"), "another text"));
+    assert(x0.setCell(CPos("B1"), "=A1=A2"));
+    assert(x0.setCell(CPos("B2"), "=A1<>A3"));
+    assert(x0.setCell(CPos("B3"), "=A3<A1"));
+    assert(x0.setCell(CPos("B4"), "=A1=\"a text longer than the short string buffer\""));
+    auto shared = [](const CSpreadsheet &sheet, const char *code)
+    { return &std::get<CText>(sheet.page.at(CPos(code)).getValue(nullptr)).str(); }; // Cell keeps the string alive
+    const std::string *first = shared(x0, "A1");
+    assert(first == shared(x0, "A2"));
+    for (const char *code : {"B1", "B2", "B4"})
+      assert(valueMatch(x0.getValue(CPos(code)), CValue(1.0)));
+    assert(valueMatch(x0.getValue(CPos("B3")), CValue(0.0)));
+    assert(valueMatch(x0.getValue(CPos("A1")), CValue("a text longer than the short string buffer")));
+    assert(x0.page.at(CPos("A3")).getContent() == "another text");
+
+    // Test 2: Loaded texts are interned too, and texts outlive the sheet that interned them
+    assert(x0.save(oss));
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    CEvalValue kept = x1.page.at(CPos("A2")).getValue(nullptr);
+    assert(shared(x1, "A1") == shared(x1, "A2"));
+    assert(x1.setCell(CPos("A1"), "1"));
+    x1 = CSpreadsheet();
+    assert(std::get<CText>(kept).str() == "a text longer than the short string buffer");
+    assert(x0.setCell(CPos("C1"), "a text longer than the short string buffer"));
+    assert(shared(x0, "C1") == first);
+
+    // Test 3: Copies drop texts interned by the original while it interns on another thread
+    assert(x0.setCell(CPos("E1"), "a text only the copies hold"));
+    std::vector<CSpreadsheet> copies(4, x0);
+    assert(x0.setCell(CPos("E1"), "1"));
+    {
+      std::vector<std::thread> workers;
+      for (CSpreadsheet &copy : copies)
+        workers.emplace_back([&copy]
+                             {
+                               for (int i = 0; i < 2000; ++i)
+                                 assert(copy.setCell(CPos(i % 8, 5), i % 2 ? "a text only the copies hold" : "another text")); });
+      for (int i = 0; i < 2000; ++i)
+        assert(x0.setCell(CPos(i % 8, 6), i % 2 ? "a text only the copies hold" : "another text"));
+      for (auto &worker : workers)
+        worker.join();
+    }
+    for (CSpreadsheet &copy : copies)
+    {
+      assert(valueMatch(copy.getValue(CPos("E7")), CValue("a text only the copies hold")));
+      assert(shared(copy, "E7") == shared(copy, "E1"));
+    }
+    assert(shared(x0, "F7") == shared(x0, "F1"));
 
+    std::cout << "Interning tests passed." << std::endl;
+}
 
-  // Display results or log them
-  std::cout << "Save & load tests passed!" << std::endl;
-};
+void concatenation_tests() {
+    CSpreadsheet x0;
+
+    // Test 1: Numbers join texts in their shortest round-trip form
+    assert(x0.setCell(CPos("A1"), "10"));
+    assert(x0.setCell(CPos("A2"), "0.1"));
+    assert(x0.setCell(CPos("A3"), "=1/3"));
+    assert(x0.setCell(CPos("A4"), "1e21"));
+    assert(x0.setCell(CPos("A5"), "-2.5e-7"));
+    assert(x0.setCell(CPos("B1"), "=A1+\" kg\""));
+    assert(x0.setCell(CPos("B2"), "=\"x=\"+A2"));
+    assert(x0.setCell(CPos("B3"), "=A3+\"\""));
+    assert(x0.setCell(CPos("B4"), "=A4+\"|\"+A5"));
+    assert(x0.setCell(CPos("B5"), "=\"a\"+\"b\""));
+    assert(valueMatch(x0.getValue(CPos("B1")), CValue("10 kg")));
+    assert(valueMatch(x0.getValue(CPos("B2")), CValue("x=0.1")));
+    assert(valueMatch(x0.getValue(CPos("B3")), CValue("0.3333333333333333")));
+    assert(valueMatch(x0.getValue(CPos("B4")), CValue("1e+21|-2.5e-07")));
+    assert(valueMatch(x0.getValue(CPos("B5")), CValue("ab")));
+    assert(std::stod(std::get<std::string>(x0.getValue(CPos("B3")))) == 1.0 / 3);
+
+    std::cout << "Concatenation tests passed." << std::endl;
+}
 
-void copyRect_tests() {
-    CSpreadsheet ss,x1;
-    std::ostringstream oss;
-    std::istringstream iss;
-    std::string data;
+void operator_tests() {
+    CSpreadsheet x0;
+
+    // Test 1: Every operator on numbers, texts and empty cells, A9 stays empty
+    assert(x0.setCell(CPos("A1"), "6"));
+    assert(x0.setCell(CPos("A2"), "4"));
+    assert(x0.setCell(CPos("A3"), "abc"));
+    assert(x0.setCell(CPos("A4"), "abd"));
+    assert(x0.setCell(CPos("A5"), "0"));
+    const std::pair<const char *, CValue> cases[] = {
+        {"=A1+A2", 10.0}, {"=A1-A2", 2.0}, {"=A1*A2", 24.0}, {"=A1/A2", 1.5}, {"=A1^A2", 1296.0},
+        {"=A1/A5", CValue()}, {"=A3+A1", "abc6"}, {"=A1+A3", "6abc"}, {"=A3+A4", "abcabd"},
+        {"=A3-A1", CValue()}, {"=A3*A1", CValue()}, {"=A3^A1", CValue()}, {"=A1+A9", CValue()}, {"=A9+A3", CValue()},
+        {"=A1=A2", 0.0}, {"=A1<>A2", 1.0}, {"=A1<A2", 0.0}, {"=A1<=A2", 0.0}, {"=A1>A2", 1.0}, {"=A1>=A2", 1.0},
+        {"=A3=A4", 0.0}, {"=A3<>A4", 1.0}, {"=A3<A4", 1.0}, {"=A3<=A3", 1.0}, {"=A3>A4", 0.0}, {"=A4>=A3", 1.0},
+        {"=A1=A3", CValue()}, {"=A3<A1", CValue()}, {"=A9=A9", CValue()}, {"=-A1", -6.0}, {"=-A3", CValue()}};
+    for (const auto &[formula, expected] : cases)
+    {
+      assert(x0.setCell(CPos("B1"), formula));
+      assert(valueMatch(x0.getValue(CPos("B1")), expected));
+    }
 
-    // Set up initial cells
-    assert(ss.setCell(CPos("A1"), "10"));
-    assert(ss.setCell(CPos("A2"), "20"));
-    assert(ss.setCell(CPos("A3"), "=A1+A2"));  // Formula should update when copied
-    assert(ss.setCell(CPos("B1"), "30"));
-    assert(ss.setCell(CPos("B2"), "=A2*2"));
+    std::cout << "Operator tests passed." << std::endl;
+}
 
-    // Test 1: Copy single cell with value
-    ss.copyRect(CPos("C1"), CPos("A1"), 1, 1);
-    assert(valueMatch(ss.getValue(CPos("C1")), CValue(10.0)));
+class CRecordingBuilder : public CExprBuilder // Writes every callback to log, accepts both parsers' argument types
+{
+public:
+  void opAdd() override { log += "+ "; }
+  void opSub() override { log += "- "; }
+  void opMul() override { log += "* "; }
+  void opDiv() override { log += "/ "; }
+  void opPow() override { log += "^ "; }
+  void opNeg() override { log += "neg "; }
+  void opEq() override { log += "= "; }
+  void opNe() override { log += "<> "; }
+  void opLt() override { log += "< "; }
+  void opLe() override { log += "<= "; }
+  void opGt() override { log += "> "; }
+  void opGe() override { log += ">= "; }
+  void valNumber(double val) override { log += "num:" + std::to_string(std::bit_cast<uint64_t>(val)) + " "; }
+  void valString(std::string val) override { valString(std::string_view(val)); }
+  void valString(std::string_view val) { log.append("str:[").append(val).append("] "); }
+  void valReference(std::string val) override { valReference(std::string_view(val)); }
+  void valReference(std::string_view val) { log.append("ref:").append(val).append(" "); }
+  void valBrokenReference() { log.append("ref:#REF! "); }
+  void valRange(std::string val) override { valRange(std::string_view(val)); }
+  void valRange(std::string_view val) { log.append("range:").append(val).append(" "); }
+  void funcCall(std::string fnName, int paramCount) override { funcCall(std::string_view(fnName), paramCount); }
+  void funcCall(std::string_view fnName, int paramCount) { log.append("call:").append(fnName).append("/" + std::to_string(paramCount) + " "); }
+  std::string log;
+};
 
-    // Test 2: Copy single cell with formula and check if the reference updates correctly
-    ss.copyRect(CPos("C3"), CPos("A3"), 1, 1);
-    assert(valueMatch(ss.getValue(CPos("C3")), CValue()));  // C3 should now be =C1+C2
+void formula_parser_tests() {
+    CSpreadsheet x0;
 
-    // Test 3: Copy a range of cells including formulas
-    ss.copyRect(CPos("D1"), CPos("A1"), 2, 2);
-    assert(valueMatch(ss.getValue(CPos("D1")), CValue(10.0)));  // Copy of A1
-    assert(valueMatch(ss.getValue(CPos("D2")), CValue(20.0)));  // Copy of A2
-    assert(valueMatch(ss.getValue(CPos("E1")), CValue(30.0)));  // Copy of B1
-    assert(valueMatch(ss.getValue(CPos("E2")), CValue(40.0)));  // Should evaluate to 40 because E2 = D2*2
+#ifdef SPREADSHEET_ARCHIVE_PARSER // Define when linking libexpression_parser.a
+    // Test 1: In-tree parser makes the same callbacks as parseExpression, and fails on the same input
+    for (const char *formula : {"=1", " = 1 + 2 * 3", "=1-2-3", "=2^3^2", "=-2^2", "=2^-2", "=--A1", "=(1+2)*3", "=1<2", "=1<=2", "=1>=2", "=1<>2",
+                                "=1=2=3", "=1>2<3", "=A1", "=$A$1+a$2*$b3", "=ZZ999", "=A1:B2", "=A1 : $B$2", "=A1:", "=sum(A1:B2)",
+                                "=SUM()", "=IF(A1>1, \"yes\", \"no\")", "=f(1,2,3)", "=f(1,)", "=\"\"", "=\"a\"\"b\"\"\"", "=\"unterminated",
+                                "=\"x\"\"", "=1.5e3", "=.5", "=5.", "=0x1A", "=0x1p3", "=0x", "=0xg", "=1e999", "=1e-999", "=1e", "=.", "=",
+                                "", "1+2", "=1+", "=(1", "=1)", "=A", "=A1(", "=$1", "=A$", "=1 2", "=+1", "=1 +\t2\n", "=a1b2", "=ABS(-A1)^2"})
+    {
+      CRecordingBuilder archive, inTree;
+      try
+      {
+        parseExpression(formula, archive);
+      }
+      catch (const std::exception &)
+      {
+        archive.log += "error";
+      }
+      try
+      {
+        parse_formula(formula, inTree);
+      }
+      catch (const std::invalid_argument &)
+      {
+        inTree.log += "error";
+      }
+      assert(archive.log == inTree.log);
+    }
+#endif
+
+    // Test 2: Sheet evaluates through in-tree parser
+    assert(CSpreadsheet::capabilities() & SPREADSHEET_PARSER);
+    assert(x0.setCell(CPos("A1"), "= \"a\"\"\" + \"b\""));
+    assert(x0.setCell(CPos("A2"), "=-2^2 + 2^3^2 + A3"));
+    assert(x0.setCell(CPos("A3"), "0x10"));
+    assert(!x0.setCell(CPos("A4"), "=A1 +"));
+    assert(valueMatch(x0.getValue(CPos("A1")), CValue("a\"b")));
+    assert(valueMatch(x0.getValue(CPos("A2")), CValue(76.0)));
+
+    std::cout << "Formula parser tests passed." << std::endl;
+}
 
-    // Test 4: Overlapping regions (source and destination overlap)
-    ss.setCell(CPos("A4"), "100");
-    ss.copyRect(CPos("A5"), CPos("A4"), 1, 1);
-    assert(valueMatch(ss.getValue(CPos("A5")), CValue(100.0)));
+double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
 
-    // Test 5: Copy to a larger range than the source covers
-    ss.copyRect(CPos("C5"), CPos("A1"), 3, 3);  // Source is only 2x2
-    assert(valueMatch(ss.getValue(CPos("C5")), CValue(10.0)));  // A1
-    assert(valueMatch(ss.getValue(CPos("C6")), CValue(20.0)));  // A2
-    assert(valueMatch(ss.getValue(CPos("D5")), CValue(30.0)));  // B1
-    assert(valueMatch(ss.getValue(CPos("D6")), CValue(40.0)));  // B2
-    // Cells without explicit source should be empty or default
-    assert(valueMatch(ss.getValue(CPos("C7")), CValue(30.)));       // Beyond A3, should be empty
-    assert(valueMatch(ss.getValue(CPos("D7")), CValue()));       // Beyond B2, should be empty
+void journal_benchmark() {
+    const unsigned rows = 100000, edits = 10000;
+    CSpreadsheet sheet;
+    for (unsigned row = 0; row < rows; ++row)
+    {
+      sheet.setCell(CPos(row, 1), std::to_string(row));
+      sheet.setCell(CPos(row, 2), "=A" + std::to_string(row) + "*2");
+    }
+    std::ostringstream base, journal;
+    auto start = std::chrono::steady_clock::now();
+    sheet.saveBinary(base);
+    double fullSave = elapsed_ms(start);
+
+    sheet.attachJournal(&journal);
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < edits; ++i)
+      sheet.setCell(CPos(i * 7 % rows, 1), std::to_string(i));
+    double journaled = elapsed_ms(start);
+
+    CSpreadsheet recovered;
+    std::istringstream baseIn(base.str()), journalIn(journal.str());
+    start = std::chrono::steady_clock::now();
+    recovered.loadBinary(baseIn);
+    double baseLoad = elapsed_ms(start);
+    recovered.replayJournal(journalIn);
+    double recovery = elapsed_ms(start);
+
+    std::cout << "journal: full save of " << 2 * rows << " cells " << fullSave << " ms, "
+              << edits << " journaled edits " << journaled << " ms (" << journal.str().size() << " bytes), "
+              << "recovery " << recovery << " ms of which base load " << baseLoad << " ms" << std::endl;
+}
 
-    // Test 6: Edge case - Copying an empty cell to a range
-    ss.copyRect(CPos("F1"), CPos("Z99"), 2, 2);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("F1")), CValue()));
-    assert(valueMatch(ss.getValue(CPos("F2")), CValue()));
-    assert(valueMatch(ss.getValue(CPos("G1")), CValue()));
-    assert(valueMatch(ss.getValue(CPos("G2")), CValue()));
+void checksum_benchmark() {
+    std::string data(64 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i)
+      data[i] = char(i * 2654435761u >> 24);
+    auto start = std::chrono::steady_clock::now();
+    uint32_t crc = crc32c(data);
+    double fast = elapsed_ms(start);
+    start = std::chrono::steady_clock::now();
+    uint32_t reference = ~crc32c_table(~0u, reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    double table = elapsed_ms(start);
+    assert(crc == reference);
+    std::cout << "crc32c: " << (data.size() >> 20) << " MiB in " << fast << " ms (" << (data.size() >> 20) / fast * 1000 << " MiB/s), "
+              << "table " << table << " ms" << std::endl;
+}
 
-    assert(ss.setCell(CPos("A2"), "=\"N8+22\""));
-    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
-    ss.copyRect(CPos("Z99"), CPos("A2"), 2, 2);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("Z99")), CValue("N8+22")));
+void compression_benchmark() {
+    const unsigned rows = 200000;
+    CSpreadsheet sheet;
+    for (unsigned row = 0; row < rows; ++row)
+    {
+      sheet.setCell(CPos(row, 1), std::to_string(1700000000 + row * 60));
+      sheet.setCell(CPos(row, 2), number_to_text(std::round(std::sin(row / 100.0) * 1000) / 100));
+    }
+    for (bool compress : {false, true})
+    {
+      std::ostringstream oss;
+      sheet.setSnapshotCompression(compress);
+      auto start = std::chrono::steady_clock::now();
+      sheet.saveBinary(oss);
+      double save = elapsed_ms(start);
+      CSpreadsheet loaded;
+      std::istringstream iss(oss.str());
+      start = std::chrono::steady_clock::now();
+      loaded.loadBinary(iss);
+      double load = elapsed_ms(start);
+      std::cout << (compress ? "compressed" : "plain") << " snapshot: " << 2 * rows << " cells, " << oss.str().size() << " bytes, save "
+                << save << " ms, load " << load << " ms" << std::endl;
+    }
+}
 
-    assert(ss.setCell(CPos("A2"), "=\"N8+22\""));
-    assert(ss.setCell(CPos("A3"), "=A2"));
+void csv_benchmark() {
+    const unsigned rows = 100000, columns = 10;
+    std::string csv;
+    for (unsigned row = 0; row < rows; ++row)
+      for (unsigned column = 0; column < columns; ++column)
+      {
+        csv += column % 3 == 2 ? "\"name " + std::to_string(row) + "\"" : number_to_text(row * 0.5 + column);
+        csv += column + 1 == columns ? '\n' : ',';
+      }
+    CSpreadsheet sheet;
+    std::istringstream iss(csv);
+    auto start = std::chrono::steady_clock::now();
+    sheet.importCSV(iss, CPos("A1"));
+    double import = elapsed_ms(start);
+    std::ostringstream oss;
+    start = std::chrono::steady_clock::now();
+    sheet.exportCSV(oss, CPos("A1"), columns, rows);
+    double exported = elapsed_ms(start);
+    std::cout << "csv: " << rows * columns << " cells (" << (csv.size() >> 20) << " MiB), import " << import << " ms, export " << exported << " ms" << std::endl;
+}
 
-    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
-    ss.copyRect(CPos("Z99"), CPos("A3"), 2, 2);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("Z99")), CValue()));
+void text_load_benchmark() {
+    const unsigned cells = 1000000;
+    CSpreadsheet sheet;
+    for (unsigned i = 0; i < cells; ++i)
+      sheet.page.emplace(CPos(i / 4, i % 4 + 1), CCell("label " + std::to_string(i)));
+    std::ostringstream oss;
+    sheet.save(oss);
+    CSpreadsheet loaded;
+    std::istringstream iss(oss.str());
+    auto start = std::chrono::steady_clock::now();
+    loaded.load(iss);
+    std::cout << "text load: " << cells << " text cells in " << elapsed_ms(start) << " ms" << std::endl;
+}
 
-    assert(valueMatch(ss.getValue(CPos("A2")), CValue("N8+22")));
-    ss.copyRect(CPos("Z99"), CPos("A2"), 2, 2);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("Z99")), CValue("N8+22")));
+class CCountingBuilder : public CExprBuilder // Cheapest possible builder, benchmark measures the parser alone
+{
+public:
+  void opAdd() override { ++calls; }
+  void opSub() override { ++calls; }
+  void opMul() override { ++calls; }
+  void opDiv() override { ++calls; }
+  void opPow() override { ++calls; }
+  void opNeg() override { ++calls; }
+  void opEq() override { ++calls; }
+  void opNe() override { ++calls; }
+  void opLt() override { ++calls; }
+  void opLe() override { ++calls; }
+  void opGt() override { ++calls; }
+  void opGe() override { ++calls; }
+  void valNumber(double) override { ++calls; }
+  void valString(std::string val) override { calls += val.size(); }
+  void valString(std::string_view val) { calls += val.size(); }
+  void valReference(std::string val) override { calls += val.size(); }
+  void valReference(std::string_view val) { calls += val.size(); }
+  void valBrokenReference() { ++calls; }
+  void valRange(std::string val) override { calls += val.size(); }
+  void valRange(std::string_view val) { calls += val.size(); }
+  void funcCall(std::string fnName, int paramCount) override { calls += fnName.size() + paramCount; }
+  void funcCall(std::string_view fnName, int paramCount) { calls += fnName.size() + paramCount; }
+  size_t calls = 0;
+};
 
+void formula_parser_benchmark() {
+    const unsigned formulas = 1000000;
+    std::vector<std::string> texts;
+    texts.reserve(formulas);
+    for (unsigned i = 0; i < formulas; ++i)
+      texts.push_back("=($A" + std::to_string(i + 1) + " + B" + std::to_string(i % 977 + 1) + ") * 2.5 - \"label\" <> sum(C1:D" +
+                      std::to_string(i % 31 + 1) + ")");
+    CCountingBuilder inTree;
+    auto start = std::chrono::steady_clock::now();
+    for (const std::string &text : texts)
+      parse_formula(text, inTree);
+    double inTreeMs = elapsed_ms(start);
+#ifdef SPREADSHEET_ARCHIVE_PARSER
+    CCountingBuilder archive;
+    start = std::chrono::steady_clock::now();
+    for (const std::string &text : texts)
+      parseExpression(text, archive);
+    assert(archive.calls == inTree.calls);
+    std::cout << "formula parser: " << formulas << " formulas, parseExpression " << elapsed_ms(start) << " ms, in-tree " << inTreeMs
+              << " ms" << std::endl;
+#else
+    std::cout << "formula parser: " << formulas << " formulas, in-tree " << inTreeMs << " ms" << std::endl;
+#endif
+}
 
-    assert(ss.setCell(CPos("A3"), "30"));
-    assert(ss.setCell(CPos("F12"), "=A3"));
-    assert(ss.setCell(CPos("C5"), "=10"));
+void parse_cache_benchmark() {
+    const unsigned formulas = 1000000;
+    std::vector<std::pair<CPos, std::string>> cells;
+    cells.reserve(formulas);
+    for (unsigned i = 0; i < formulas; ++i)
+      cells.emplace_back(CPos(i / 4 + 1, i % 4 + 2), "=($A" + std::to_string(i / 4 + 1) + " + " + back_to_code(i / 4 + 1, i % 4 + 1) + ") * 2.5 - $B$1");
+    CCell cell;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &[pos, text] : cells)
+      CCell::parse(text, cell);
+    double parseMs = elapsed_ms(start);
+    CParseCache cache;
+    start = std::chrono::steady_clock::now();
+    for (const auto &[pos, text] : cells)
+      cache.parse(text, pos, cell);
+    double cacheMs = elapsed_ms(start);
+    std::cout << "parse cache: " << formulas << " formulas, " << cache.size() << " distinct, parse " << parseMs << " ms, cache "
+              << cacheMs << " ms" << std::endl;
+}
 
-  //  ss.copyRect(CPos("F12"), CPos("A3"), 1, 1);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("F12")), CValue(30.)));
-    ss.copyRect(CPos("G13"), CPos("F12"), 1, 1);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("G13")), CValue()));
-    ss.copyRect(CPos("H14"), CPos("G13"), 1, 1);  // Assuming Z99 is empty
-    assert(valueMatch(ss.getValue(CPos("H14")), CValue(10.)));
+void copy_benchmark() {
+    const int w = 500, h = 2000;
+    CSpreadsheet sheet;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 0; row < h; ++row)
+      for (int col = 0; col < w; ++col)
+        cells.emplace_back(CPos(row, col + 2), col % 2 ? "=$A" + std::to_string(row) + " + " + back_to_code(row, col + 1) + " * 2" : "label " + std::to_string(col));
+    sheet.setCells(cells);
+    auto start = std::chrono::steady_clock::now();
+    sheet.copyRect(CPos(h / 2, 3), CPos(0, 2), w, h);
+    std::cout << "copy: " << w * h << " cells, half formulas, overlapping, in " << elapsed_ms(start) << " ms" << std::endl;
+}
 
-      oss.str("");
-    oss.clear();
-    iss.clear();
+void fill_benchmark() {
+    const int rows = 500000;
+    CSpreadsheet sheet;
+    assert(sheet.setCell(CPos("A1"), "1"));
+    assert(sheet.setCell(CPos("B1"), "item"));
+    assert(sheet.setCell(CPos("C1"), "=A1*$F$1"));
+    assert(sheet.setCell(CPos("D1"), "=C1+D0"));
+    auto start = std::chrono::steady_clock::now();
+    sheet.fillSeries(CPos("A1"), 4, 1, rows - 1, 1);
+    double ms = elapsed_ms(start);
+    std::cout << "fill: " << rows * 4 << " cells in " << ms << " ms (" << rows * 4 / ms / 1000 << " M cells/s)" << std::endl;
+}
 
-  // Test 4: Save and Load with special characters
-    CSpreadsheet s1;
-    assert(s1.setCell(CPos("A1"), "1"));
-    assert(s1.setCell(CPos("B1"), "2"));
-    assert(s1.setCell(CPos("C1"), "3"));
-    assert(s1.setCell(CPos("A2"), "4"));
-    assert(s1.setCell(CPos("B2"), "5"));
-    assert(s1.setCell(CPos("C2"), "6"));
-    assert(s1.setCell(CPos("A3"), "7"));
-    assert(s1.setCell(CPos("B3"), "8"));
-    assert(s1.setCell(CPos("C3"), "=A1+B1+C1+A2+B2+C2+A3+B3"));
-    assert(valueMatch(s1.getValue(CPos("C3")), 36.0));
-    s1.copyRect(CPos("B2"), CPos("A1"), 3, 3);
+void shift_benchmark() {
+    const int rows = 1000000;
+    CSpreadsheet sheet;
+    assert(sheet.setCell(CPos("A1"), "1"));
+    assert(sheet.setCell(CPos("B1"), "=A1*2+$C$1"));
+    assert(sheet.setCell(CPos("C1"), "0"));
+    sheet.fillSeries(CPos("A1"), 2, 1, rows - 1, 1);
+    auto start = std::chrono::steady_clock::now();
+    assert(sheet.insertRows(2));
+    double insertMs = elapsed_ms(start);
+    start = std::chrono::steady_clock::now();
+    assert(sheet.deleteRows(2));
+    double deleteMs = elapsed_ms(start);
+    assert(valueMatch(sheet.getValue(CPos(rows, 2)), CValue(2.0 * rows)));
+    std::cout << "shift: row inserted above " << rows << " rows in " << insertMs << " ms, deleted in " << deleteMs << " ms" << std::endl;
+}
 
-    assert(s1.setCell(CPos("A1"), "= A2 + A3"));
-    assert(s1.setCell(CPos("A2"), "= A4"));
-    assert(s1.setCell(CPos("A3"), "= A4"));
-    assert(s1.setCell(CPos("A4"), "100"));
+void text_compare_benchmark() {
+    const int rows = 200000;
+    CSpreadsheet sheet;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; ++row)
+    {
+      cells.emplace_back(CPos(row, 1), "category number " + std::to_string(row % 100) + " of the sheet");
+      cells.emplace_back(CPos(row, 2), "=A" + std::to_string(row) + "=A" + std::to_string(row + 100));
+      cells.emplace_back(CPos(row, 3), "=A" + std::to_string(row));
+    }
+    assert(sheet.setCells(cells));
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CValue> values = sheet.getValues(CPos(1, 2), 2, rows);
+    double ms = elapsed_ms(start);
+    assert(valueMatch(values[0], CValue(1.0)));
+    std::cout << "text compare: " << rows * 2 << " formulas over texts in " << ms << " ms" << std::endl;
+}
 
-    assert(valueMatch(s1.getValue(CPos("A1")), 200.));
-    assert(valueMatch(s1.getValue(CPos("A2")), 100.));
-    assert(valueMatch(s1.getValue(CPos("A3")), 100.));
-    assert(valueMatch(s1.getValue(CPos("A4")), 100.));
+void concatenation_benchmark() {
+    const int rows = 200000;
+    CSpreadsheet sheet;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; ++row)
+    {
+      cells.emplace_back(CPos(row, 1), std::to_string(row * 0.25));
+      cells.emplace_back(CPos(row, 2), "=\"#\"+A" + std::to_string(row) + "+\" kg\"");
+    }
+    assert(sheet.setCells(cells));
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CValue> values = sheet.getValues(CPos(1, 2), 1, rows);
+    double ms = elapsed_ms(start);
+    std::cout << "concatenation: " << rows << " text-building formulas in " << ms << " ms" << std::endl;
+}
 
+template <typename TNode>
+void operator_benchmark(const char *name, const ExprPtr &left, const ExprPtr &right)
+{
+    const int rounds = 5000000;
+    ExprPtr node = std::make_shared<TNode>(left, right); // Evaluated through the base class, as formulas are
+    size_t results = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i)
+      results += node->eval(nullptr).index();
+    double ms = elapsed_ms(start);
+    std::cout << "operator " << name << ": " << ms * 1e6 / rounds << " ns per node (" << results % 7 << ")" << std::endl;
+}
 
+void operators_benchmark() {
+    std::string abc = "abc", abd = "abd";
+    ExprPtr six = std::make_shared<Numeric>(6), four = std::make_shared<Numeric>(4);
+    ExprPtr first = std::make_shared<Text>(abc), second = std::make_shared<Text>(abd);
+    operator_benchmark<Sum>("+", six, four);
+    operator_benchmark<Subtraction>("-", six, four);
+    operator_benchmark<Multiplication>("*", six, four);
+    operator_benchmark<Division>("/", six, four);
+    operator_benchmark<Power>("^", six, four);
+    operator_benchmark<Equal>("=", six, four);
+    operator_benchmark<NotEqual>("<>", six, four);
+    operator_benchmark<LowerThen>("<", six, four);
+    operator_benchmark<LowerEq>("<=", six, four);
+    operator_benchmark<GreaterThen>(">", six, four);
+    operator_benchmark<GreaterEqual>(">=", six, four);
+    operator_benchmark<Sum>("text + number", first, six);
+    operator_benchmark<Equal>("text = text", first, second);
+    operator_benchmark<LowerThen>("text < text", first, second);
+    operator_benchmark<Multiplication>("text * number", first, six);
+}
 
-    std::cout << "CopyRect tests passed." << std::endl;
+void run_benchmarks() {
+    journal_benchmark();
+    checksum_benchmark();
+    compression_benchmark();
+    csv_benchmark();
+    text_load_benchmark();
+    formula_parser_benchmark();
+    parse_cache_benchmark();
+    copy_benchmark();
+    fill_benchmark();
+    shift_benchmark();
+    text_compare_benchmark();
+    concatenation_benchmark();
+    operators_benchmark();
 }
 
 
-int main ()
+int main (int argc, char *argv[])
 {
+  if (argc > 1 && argv[1] == "--bench"s)
+  {
+    run_benchmarks();
+    return EXIT_SUCCESS;
+  }
   //runTests();
   save_load_tests();
   basic_tests();
   copyRect_tests();
+  batch_tests();
+  getValues_tests();
+  visitCells_tests();
+  binary_snapshot_tests();
+  mapped_snapshot_tests();
+  parallel_load_tests();
+  lazy_parsing_tests();
+  persisted_values_tests();
+  journal_tests();
+  block_checksum_tests();
+  compressed_snapshot_tests();
+  csv_tests();
+  paging_tests();
+  classification_tests();
+  formula_parser_tests();
+  dependency_tests();
+  parse_cache_tests();
+  relocation_tests();
+  bulk_copy_tests();
+  fill_tests();
+  shift_tests();
+  interning_tests();
+  concatenation_tests();
+  operator_tests();
   CSpreadsheet x0, x1;
   std::ostringstream oss;
   std::istringstream iss;